@@ -0,0 +1,75 @@
+#include "audio_convert.h"
+
+#include <cstddef>
+
+std::vector<float> remap_channels(const std::vector<float>& input,
+                                  int inChannels, int outChannels)
+{
+    if (inChannels == outChannels || inChannels <= 0 || outChannels <= 0) {
+        return input;
+    }
+
+    const size_t frames = input.size() / inChannels;
+    std::vector<float> output(frames * outChannels, 0.0f);
+
+    if (inChannels == 1) {
+        for (size_t f = 0; f < frames; f++) {
+            for (int c = 0; c < outChannels; c++) {
+                output[f * outChannels + c] = input[f];
+            }
+        }
+    } else if (outChannels == 1) {
+        const float scale = 1.0f / inChannels;
+        for (size_t f = 0; f < frames; f++) {
+            float sum = 0.0f;
+            for (int c = 0; c < inChannels; c++) {
+                sum += input[f * inChannels + c];
+            }
+            output[f] = sum * scale;
+        }
+    } else {
+        const int shared = inChannels < outChannels ? inChannels : outChannels;
+        for (size_t f = 0; f < frames; f++) {
+            for (int c = 0; c < shared; c++) {
+                output[f * outChannels + c] = input[f * inChannels + c];
+            }
+        }
+    }
+
+    return output;
+}
+
+std::vector<float> resample_linear(const std::vector<float>& input,
+                                   int channels, int inRate, int outRate)
+{
+    if (inRate == outRate || inRate <= 0 || outRate <= 0 || channels <= 0) {
+        return input;
+    }
+
+    const size_t inFrames = input.size() / channels;
+    if (inFrames == 0) {
+        return std::vector<float>();
+    }
+
+    const size_t outFrames = (size_t)((double)inFrames * outRate / inRate);
+    const double step = (double)inRate / outRate;
+    std::vector<float> output(outFrames * channels);
+
+    for (size_t f = 0; f < outFrames; f++) {
+        const double srcPos = f * step;
+        size_t i0 = (size_t)srcPos;
+        if (i0 >= inFrames) {
+            i0 = inFrames - 1;
+        }
+        const size_t i1 = i0 + 1 < inFrames ? i0 + 1 : i0;
+        const float frac = (float)(srcPos - (double)i0);
+
+        for (int c = 0; c < channels; c++) {
+            const float a = input[i0 * channels + c];
+            const float b = input[i1 * channels + c];
+            output[f * channels + c] = a + (b - a) * frac;
+        }
+    }
+
+    return output;
+}
@@ -0,0 +1,16 @@
+#ifndef AUDIO_CONVERT_H
+#define AUDIO_CONVERT_H
+
+#include <vector>
+
+// Convert interleaved samples between channel counts. Mono is duplicated
+// into every output channel, a downmix to mono averages the inputs, and
+// other layouts copy the channels they share and silence the rest.
+std::vector<float> remap_channels(const std::vector<float>& input,
+                                  int inChannels, int outChannels);
+
+// Linear-interpolation sample rate conversion of interleaved samples.
+std::vector<float> resample_linear(const std::vector<float>& input,
+                                   int channels, int inRate, int outRate);
+
+#endif
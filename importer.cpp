@@ -0,0 +1,199 @@
+#include "importer.h"
+#include "audio_convert.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <sndfile.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+
+namespace {
+
+const sf_count_t kDecodeBlockFrames = 65536;
+
+}
+
+struct ImportJob {
+    ImportJob() : framesDone(0), framesTotal(0), finished(false), taken(false) {}
+
+    std::atomic<size_t> framesDone;
+    std::atomic<size_t> framesTotal;
+    bool finished;
+    bool taken;
+    ImportResult result;
+};
+
+// Shared between the Importer and the decode tasks, which may still be
+// running when the Importer goes away.
+struct ImportBatch {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ImportJob>> jobs;
+    std::function<void()> notify;
+    std::atomic<bool> cancelled;
+    size_t remaining;
+    size_t nextOrdered;
+    bool ordered;
+};
+
+static void decode_file(ImportBatch& batch, ImportJob& job, int channels, int sampleRate) {
+    TRACE_SCOPE("Importer::decode_file");
+    ImportResult& result = job.result;
+
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+    SNDFILE* file = sf_open(result.filename.c_str(), SFM_READ, &sfinfo);
+
+    if (file) {
+        job.framesTotal = (size_t)sfinfo.frames;
+        result.samples.reserve(sfinfo.frames * sfinfo.channels);
+
+        std::vector<float> block(kDecodeBlockFrames * sfinfo.channels);
+        for (;;) {
+            if (batch.cancelled) {
+                break;
+            }
+            sf_count_t frames = sf_readf_float(file, block.data(), kDecodeBlockFrames);
+            if (frames <= 0) {
+                break;
+            }
+            result.samples.insert(result.samples.end(), block.begin(),
+                                  block.begin() + frames * sfinfo.channels);
+            job.framesDone += (size_t)frames;
+        }
+        sf_close(file);
+
+        result.channels = sfinfo.channels;
+        result.sampleRate = sfinfo.samplerate;
+        result.format = sfinfo.format;
+        if (channels > 0 && channels != result.channels) {
+            result.samples = remap_channels(result.samples, result.channels, channels);
+            result.channels = channels;
+        }
+        if (sampleRate > 0 && sampleRate != result.sampleRate) {
+            result.samples = resample_linear(result.samples, result.channels,
+                                             result.sampleRate, sampleRate);
+            result.sampleRate = sampleRate;
+        }
+        result.ok = !batch.cancelled;
+    } else {
+        // Count unreadable files as done so progress still reaches the end
+        job.framesTotal = 1;
+        job.framesDone = 1;
+    }
+
+    std::lock_guard<std::mutex> lock(batch.mutex);
+    job.finished = true;
+    batch.remaining--;
+    if (batch.notify) {
+        batch.notify();
+    }
+}
+
+Importer::Importer(std::function<void()> notify)
+    : m_Notify(notify)
+{
+}
+
+Importer::~Importer() {
+    if (m_Batch) {
+        std::lock_guard<std::mutex> lock(m_Batch->mutex);
+        m_Batch->cancelled = true;
+        m_Batch->notify = nullptr;
+    }
+}
+
+bool Importer::start(const std::vector<std::string>& files, int channels, int sampleRate,
+                     bool ordered)
+{
+    if (busy() || files.empty()) {
+        return false;
+    }
+
+    std::shared_ptr<ImportBatch> batch(new ImportBatch);
+    batch->notify = m_Notify;
+    batch->cancelled = false;
+    batch->remaining = files.size();
+    batch->nextOrdered = 0;
+    batch->ordered = ordered;
+
+    for (const auto& filename : files) {
+        std::unique_ptr<ImportJob> job(new ImportJob);
+        job->result.filename = filename;
+        job->result.channels = 0;
+        job->result.sampleRate = 0;
+        job->result.format = 0;
+        job->result.ok = false;
+        batch->jobs.push_back(std::move(job));
+    }
+
+    m_Batch = batch;
+
+    for (auto& job : batch->jobs) {
+        ImportJob* jobPtr = job.get();
+        WorkerPool::shared().submit([batch, jobPtr, channels, sampleRate] {
+            decode_file(*batch, *jobPtr, channels, sampleRate);
+        });
+    }
+
+    return true;
+}
+
+bool Importer::busy() const {
+    if (!m_Batch) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_Batch->mutex);
+    if (m_Batch->remaining > 0) {
+        return true;
+    }
+    for (const auto& job : m_Batch->jobs) {
+        if (!job->taken) {
+            return true;
+        }
+    }
+    return false;
+}
+
+double Importer::progress() const {
+    if (!m_Batch || m_Batch->jobs.empty()) {
+        return 0.0;
+    }
+
+    double sum = 0.0;
+    for (const auto& job : m_Batch->jobs) {
+        const size_t total = job->framesTotal;
+        if (total > 0) {
+            sum += std::min(1.0, (double)job->framesDone / total);
+        }
+    }
+    return sum / m_Batch->jobs.size();
+}
+
+std::vector<ImportResult> Importer::take_ready() {
+    std::vector<ImportResult> ready;
+    if (!m_Batch) {
+        return ready;
+    }
+
+    std::lock_guard<std::mutex> lock(m_Batch->mutex);
+    auto& jobs = m_Batch->jobs;
+
+    if (m_Batch->ordered) {
+        while (m_Batch->nextOrdered < jobs.size() && jobs[m_Batch->nextOrdered]->finished) {
+            ImportJob& job = *jobs[m_Batch->nextOrdered++];
+            job.taken = true;
+            ready.push_back(std::move(job.result));
+        }
+    } else {
+        for (auto& job : jobs) {
+            if (job->finished && !job->taken) {
+                job->taken = true;
+                ready.push_back(std::move(job->result));
+            }
+        }
+    }
+
+    return ready;
+}
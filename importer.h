@@ -0,0 +1,47 @@
+#ifndef IMPORTER_H
+#define IMPORTER_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct ImportResult {
+    std::string filename;
+    std::vector<float> samples;
+    int channels;
+    int sampleRate;
+    int format;     // libsndfile format of the source file
+    bool ok;
+};
+
+struct ImportBatch;
+
+// Decodes a batch of files concurrently on the worker pool, converting
+// each to the requested format as it goes. The notify callback is invoked
+// from a worker thread whenever a file finishes; the GUI then collects the
+// finished files with take_ready().
+class Importer {
+public:
+    explicit Importer(std::function<void()> notify);
+    ~Importer();
+
+    // Start decoding files. Pass 0 for channels and sampleRate to keep
+    // each file's own format. With ordered set, take_ready() hands files
+    // back in the order given here; otherwise in the order they finish.
+    bool start(const std::vector<std::string>& files, int channels, int sampleRate,
+               bool ordered);
+
+    bool busy() const;
+
+    // Fraction of the current batch that has been decoded, 0 .. 1.
+    double progress() const;
+
+    std::vector<ImportResult> take_ready();
+
+private:
+    std::function<void()> m_Notify;
+    std::shared_ptr<ImportBatch> m_Batch;
+};
+
+#endif
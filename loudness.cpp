@@ -0,0 +1,281 @@
+#include "loudness.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace {
+
+const size_t kSubblocksPerChunk = 100;     // 10 s of audio per task
+const size_t kGainChunk = 1 << 18;
+const double kAbsoluteGate = -70.0;
+const double kRelativeGate = -10.0;
+
+const int kOversample = 4;
+const int kTapsPerPhase = 12;
+
+struct Biquad {
+    double b0, b1, b2, a1, a2;
+};
+
+struct BiquadState {
+    BiquadState() : z1(0.0), z2(0.0) {}
+
+    double process(const Biquad& f, double x) {
+        double y = f.b0 * x + z1;
+        z1 = f.b1 * x - f.a1 * y + z2;
+        z2 = f.b2 * x - f.a2 * y;
+        return y;
+    }
+
+    double z1, z2;
+};
+
+// The two K-weighting stages from BS.1770, recomputed for sampleRate
+void k_weighting(int sampleRate, Biquad& shelf, Biquad& highpass) {
+    double f0 = 1681.974450955533;
+    double gain = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = std::tan(M_PI * f0 / sampleRate);
+    double vh = std::pow(10.0, gain / 20.0);
+    double vb = std::pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    shelf.b1 = 2.0 * (k * k - vh) / a0;
+    shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = std::tan(M_PI * f0 / sampleRate);
+    a0 = 1.0 + k / q + k * k;
+    highpass.b0 = 1.0;
+    highpass.b1 = -2.0;
+    highpass.b2 = 1.0;
+    highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+    highpass.a2 = (1.0 - k / q + k * k) / a0;
+}
+
+// Windowed-sinc 4x interpolator, one normalised set of taps per phase
+void oversampling_taps(double taps[kOversample][kTapsPerPhase]) {
+    const int length = kOversample * kTapsPerPhase;
+    const double centre = length / 2;
+    for (int phase = 0; phase < kOversample; phase++) {
+        double sum = 0.0;
+        for (int k = 0; k < kTapsPerPhase; k++) {
+            const int n = k * kOversample + phase;
+            const double t = (n - centre) / kOversample;
+            const double sinc = t == 0.0 ? 1.0 : std::sin(M_PI * t) / (M_PI * t);
+            const double window = 0.5 - 0.5 * std::cos(2.0 * M_PI * n / length);
+            taps[phase][k] = sinc * window;
+            sum += taps[phase][k];
+        }
+        for (int k = 0; k < kTapsPerPhase; k++) {
+            taps[phase][k] /= sum;
+        }
+    }
+}
+
+// BS.1770 channel weights. Five and six channels are taken in WAV order
+// (L R C [LFE] Ls Rs): the surrounds count +1.5 dB and the LFE not at all.
+// Layouts the standard does not define weight every channel equally.
+std::vector<double> channel_weights(int channels) {
+    std::vector<double> weights(channels, 1.0);
+    if (channels == 5) {
+        weights[3] = weights[4] = 1.41;
+    } else if (channels == 6) {
+        weights[3] = 0.0;
+        weights[4] = weights[5] = 1.41;
+    }
+    return weights;
+}
+
+struct ChunkResult {
+    std::vector<double> subblocks;  // weighted sum over channels of z^2, per sub-block
+    double sumSquares;
+    double samplePeak;
+    double truePeak;
+};
+
+void measure_chunk(const float* samples, size_t frames, int channels, int sampleRate,
+                   size_t subblockFrames, size_t begin, size_t end, ChunkResult& result)
+{
+    Biquad shelf, highpass;
+    k_weighting(sampleRate, shelf, highpass);
+    double taps[kOversample][kTapsPerPhase];
+    oversampling_taps(taps);
+    const std::vector<double> weights = channel_weights(channels);
+
+    std::vector<BiquadState> shelfState(channels);
+    std::vector<BiquadState> highpassState(channels);
+    std::vector<double> history(channels * kTapsPerPhase, 0.0);
+
+    // The filters are recursive, so run them over half a second before
+    // the chunk; the K-weighting poles decay far below float precision
+    // in that time, which makes the seams exact in practice.
+    const size_t warmup = std::min(begin, (size_t)sampleRate / 2);
+
+    const size_t subblocks = (end - begin + subblockFrames - 1) / subblockFrames;
+    result.subblocks.assign(subblocks, 0.0);
+    result.sumSquares = 0.0;
+    result.samplePeak = 0.0;
+    result.truePeak = 0.0;
+
+    for (size_t f = begin - warmup; f < end && f < frames; f++) {
+        const bool counted = f >= begin;
+        double energy = 0.0;
+
+        for (int c = 0; c < channels; c++) {
+            const double x = samples[f * channels + c];
+
+            const double z = highpassState[c].process(highpass,
+                                                      shelfState[c].process(shelf, x));
+
+            double* h = &history[c * kTapsPerPhase];
+            std::copy_backward(h, h + kTapsPerPhase - 1, h + kTapsPerPhase);
+            h[0] = x;
+
+            if (!counted) {
+                continue;
+            }
+
+            energy += weights[c] * z * z;
+            result.sumSquares += x * x;
+            result.samplePeak = std::max(result.samplePeak, std::fabs(x));
+            for (int phase = 0; phase < kOversample; phase++) {
+                double y = 0.0;
+                for (int k = 0; k < kTapsPerPhase; k++) {
+                    y += h[k] * taps[phase][k];
+                }
+                result.truePeak = std::max(result.truePeak, std::fabs(y));
+            }
+        }
+
+        if (counted) {
+            result.subblocks[(f - begin) / subblockFrames] += energy;
+        }
+    }
+}
+
+double block_loudness(double meanEnergy) {
+    return -0.691 + 10.0 * std::log10(meanEnergy);
+}
+
+}
+
+LoudnessStats measure_loudness(const float* samples, size_t count,
+                               int channels, int sampleRate)
+{
+    TRACE_SCOPE("measure_loudness");
+    LoudnessStats stats;
+    stats.integrated = -HUGE_VAL;
+    stats.truePeak = 0.0;
+    stats.samplePeak = 0.0;
+    stats.rms = 0.0;
+
+    if (channels <= 0 || sampleRate <= 0 || count < (size_t)channels) {
+        return stats;
+    }
+
+    const size_t frames = count / channels;
+    const size_t subblockFrames = std::max<size_t>(1, (size_t)std::lround(sampleRate * 0.1));
+    const size_t chunkFrames = subblockFrames * kSubblocksPerChunk;
+    const size_t chunks = (frames + chunkFrames - 1) / chunkFrames;
+
+    std::vector<ChunkResult> results(chunks);
+    WorkerPool::shared().parallel_for(chunks, [&](size_t chunk) {
+        const size_t begin = chunk * chunkFrames;
+        const size_t end = std::min(begin + chunkFrames, frames);
+        measure_chunk(samples, frames, channels, sampleRate, subblockFrames,
+                      begin, end, results[chunk]);
+    });
+
+    // Chunks are whole sub-blocks, so concatenating them gives exactly the
+    // sub-block sequence of a single pass
+    std::vector<double> subblocks;
+    double sumSquares = 0.0;
+    for (const auto& result : results) {
+        subblocks.insert(subblocks.end(), result.subblocks.begin(), result.subblocks.end());
+        sumSquares += result.sumSquares;
+        stats.samplePeak = std::max(stats.samplePeak, result.samplePeak);
+        stats.truePeak = std::max(stats.truePeak, result.truePeak);
+    }
+    stats.rms = std::sqrt(sumSquares / (frames * channels));
+
+    // 400 ms gating blocks with 75% overlap are four consecutive complete
+    // sub-blocks; a trailing partial sub-block never starts a full block.
+    const size_t complete = frames / subblockFrames;
+    std::vector<double> blocks;
+    for (size_t i = 0; i + 4 <= complete; i++) {
+        const double energy = subblocks[i] + subblocks[i + 1] + subblocks[i + 2] + subblocks[i + 3];
+        blocks.push_back(energy / (4.0 * subblockFrames));
+    }
+
+    double absoluteSum = 0.0;
+    size_t absoluteCount = 0;
+    for (double energy : blocks) {
+        if (energy > 0.0 && block_loudness(energy) > kAbsoluteGate) {
+            absoluteSum += energy;
+            absoluteCount++;
+        }
+    }
+    if (absoluteCount == 0) {
+        return stats;
+    }
+
+    const double relativeGate = block_loudness(absoluteSum / absoluteCount) + kRelativeGate;
+    double gatedSum = 0.0;
+    size_t gatedCount = 0;
+    for (double energy : blocks) {
+        if (energy > 0.0) {
+            const double loudness = block_loudness(energy);
+            if (loudness > kAbsoluteGate && loudness > relativeGate) {
+                gatedSum += energy;
+                gatedCount++;
+            }
+        }
+    }
+    if (gatedCount > 0) {
+        stats.integrated = block_loudness(gatedSum / gatedCount);
+    }
+
+    return stats;
+}
+
+bool loudness_layout_supported(int channels) {
+    return channels == 1 || channels == 2 || channels == 5 || channels == 6;
+}
+
+double loudness_gain_db(const LoudnessStats& stats, double targetLufs,
+                        double ceilingDbtp, bool& limited)
+{
+    limited = false;
+    if (!std::isfinite(stats.integrated)) {
+        return 0.0;
+    }
+
+    double gain = targetLufs - stats.integrated;
+    if (stats.truePeak > 0.0) {
+        const double headroom = ceilingDbtp - 20.0 * std::log10(stats.truePeak);
+        if (gain > headroom) {
+            gain = headroom;
+            limited = true;
+        }
+    }
+    return gain;
+}
+
+void apply_gain(float* samples, size_t count, float gain) {
+    TRACE_SCOPE("apply_gain");
+    const size_t chunks = (count + kGainChunk - 1) / kGainChunk;
+    WorkerPool::shared().parallel_for(chunks, [=](size_t chunk) {
+        float* p = samples + chunk * kGainChunk;
+        const size_t n = std::min(kGainChunk, count - chunk * kGainChunk);
+        for (size_t i = 0; i < n; i++) {
+            p[i] *= gain;
+        }
+    });
+}
@@ -0,0 +1,35 @@
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include <cstddef>
+
+// Levels as linear amplitudes, except integrated loudness which is in
+// LUFS (-HUGE_VAL when everything is below the absolute gate).
+struct LoudnessStats {
+    double integrated;
+    double truePeak;
+    double samplePeak;
+    double rms;
+};
+
+// ITU-R BS.1770 / EBU R128 measurement in one pass over the buffer:
+// K-weighted gated loudness, 4x oversampled true peak, sample peak and
+// RMS. Chunks are measured on the worker pool and merged at the level of
+// 100 ms gating sub-blocks, so the gating matches a sequential pass.
+LoudnessStats measure_loudness(const float* samples, size_t count,
+                               int channels, int sampleRate);
+
+// Whether BS.1770 defines channel weights for this layout: mono, stereo
+// and 5.0/5.1 in WAV channel order. Anything else is measured with every
+// channel weighted equally, which is not a standard loudness figure.
+bool loudness_layout_supported(int channels);
+
+// Gain in dB that takes stats to targetLufs, reduced if needed so the
+// true peak stays at or below ceilingDbtp. limited reports the reduction.
+double loudness_gain_db(const LoudnessStats& stats, double targetLufs,
+                        double ceilingDbtp, bool& limited);
+
+// samples[i] *= gain, split across the worker pool.
+void apply_gain(float* samples, size_t count, float gain);
+
+#endif
@@ -7,12 +7,29 @@
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <atomic>
+
+#include "importer.h"
+#include "loudness.h"
+#include "noise_reduction.h"
+#include "peak_cache.h"
+#include "peaks.h"
+#include "playback_clock.h"
+#include "session.h"
+#include "trace.h"
 
 // Suppress ALSA error messages
 extern "C" {
     #include <alsa/asoundlib.h>
 }
 
+static const unsigned long kFramesPerBuffer = 256;
+static const size_t kNoSeek = (size_t)-1;
+static const double kTargetLoudness = -23.0;    // LUFS, EBU R128
+static const double kTruePeakCeiling = -1.0;    // dBTP
+static const float kNoiseReductionDb = 18.0f;
+static const double kNoiseProfileSeconds = 2.0;
+
 static void alsa_error_handler(const char *file, int line, 
                                const char *function, int err, 
                                const char *fmt, ...) {
@@ -48,8 +65,23 @@ protected:
     void on_menu_effects_decrease_speed();
     void on_menu_effects_add_echo();
     void on_menu_effects_reverse();
+    void on_menu_effects_analyze_loudness();
+    void on_menu_effects_normalize_loudness();
+    void on_menu_effects_normalize_peak();
+    void on_menu_effects_learn_noise();
+    void on_menu_effects_reduce_noise();
+    void on_menu_effects_reduce_noise_recording();
+    
+    void on_menu_tracks_add_file();
+    void on_menu_tracks_add_recording();
+    void on_menu_tracks_mixer();
+    void on_menu_tracks_clear();
+    void on_menu_tracks_bounce();
     
     void on_menu_help_about();
+#ifdef MR_TRACING
+    void on_menu_help_export_trace();
+#endif
     
     void on_button_rewind();
     void on_button_fast_forward();
@@ -57,9 +89,14 @@ protected:
     void on_button_stop();
     void on_button_record();
     
+    void on_import_ready();
+    
     bool on_waveform_draw(const Cairo::RefPtr<Cairo::Context>& cr);
     bool update_position();
+    bool on_playhead_tick(const Glib::RefPtr<Gdk::FrameClock>& clock);
     void on_position_scale_changed();
+    bool on_position_scale_pressed(GdkEventButton* event);
+    bool on_position_scale_released(GdkEventButton* event);
     
     static int paCallback(const void *inputBuffer, void *outputBuffer,
                          unsigned long framesPerBuffer,
@@ -68,17 +105,25 @@ protected:
                          void *userData);
 
 private:
+    enum ImportTarget {
+        IMPORT_REPLACE,
+        IMPORT_INSERT,
+        IMPORT_TRACKS
+    };
+    
     Gtk::Box m_VBox;
     
     Gtk::MenuBar m_MenuBar;
     Gtk::MenuItem m_MenuItemFile;
     Gtk::MenuItem m_MenuItemEdit;
     Gtk::MenuItem m_MenuItemEffects;
+    Gtk::MenuItem m_MenuItemTracks;
     Gtk::MenuItem m_MenuItemHelp;
     
     Gtk::Menu m_MenuFile;
     Gtk::Menu m_MenuEdit;
     Gtk::Menu m_MenuEffects;
+    Gtk::Menu m_MenuTracks;
     Gtk::Menu m_MenuHelp;
     
     Gtk::Box m_TopDisplayBox;
@@ -97,14 +142,41 @@ private:
     Gtk::Button m_ButtonStop;
     Gtk::Button m_ButtonRecord;
     Gtk::Scale* m_PositionScale;
+    Gtk::CheckMenuItem* m_ReduceNoiseRecording;
+    Gtk::ProgressBar m_ImportProgress;
     
     std::vector<float> m_AudioBuffer;
     std::vector<float> m_ClipboardBuffer;
+    PeakPyramid m_Peaks;
+    std::string m_SavedFile;   // file the buffer still matches, if any
+    int m_SavedFormat;
+    Session m_Session;
     size_t m_CurrentPosition;
     size_t m_PlaybackPosition;
-    bool m_IsPlaying;
+    size_t m_PlaybackEnd;
+    std::atomic<bool> m_IsPlaying;
     bool m_IsRecording;
     
+    // Noise reduction. The capture reducer is only configured while no
+    // stream is running, and only the audio callback uses it during one.
+    NoiseProfile m_NoiseProfile;
+    NoiseReducer m_CaptureNoise;
+    std::vector<float> m_CaptureScratch;
+    bool m_ReduceCaptureNoise;
+    
+    // Playhead and seeking. While the stream runs only the audio callback
+    // moves m_PlaybackPosition; the GUI posts seeks through m_SeekRequest.
+    PlaybackClock m_Clock;
+    std::atomic<size_t> m_SeekRequest;
+    std::atomic<unsigned> m_SeekIssued;
+    std::atomic<unsigned> m_SeekApplied;
+    std::atomic<bool> m_Scrubbing;
+    size_t m_ScrubRemaining;
+    size_t m_ScrubGrain;
+    bool m_ScrubResume;
+    double m_OutputLatency;
+    guint m_TickId;
+    
     int m_SampleRate;
     int m_Channels;
     std::string m_CurrentFile;
@@ -112,12 +184,33 @@ private:
     PaStream *m_Stream;
     sigc::connection m_TimerConnection;
     bool m_UpdatingPositionScale;
+    
+    Glib::Dispatcher m_ImportDispatcher;
+    Importer m_Importer;
+    ImportTarget m_ImportTarget;
+    size_t m_ImportPosition;
+    std::vector<std::string> m_ImportFailures;
+    
+    // A file being opened. The document stays as it is until the decode
+    // succeeds; meanwhile the new file's cached overview, if any, is shown.
+    std::string m_LoadingFile;
+    PeakPyramid m_LoadingPeaks;
+    int m_LoadingRate;
+    std::vector<Gtk::Widget*> m_LoadingDisabled;  // insensitive while opening
         
     void init_audio();
     void cleanup_audio();
     void load_audio_file(const std::string& filename);
+    bool start_import(const std::vector<std::string>& files, ImportTarget target);
+    void set_loading(const std::string& filename);
+    void document_changed();
+    LoudnessStats document_loudness();
     void save_audio_file(const std::string& filename);
     void update_displays();
+    size_t session_length() const;
+    size_t playhead_position();
+    void seek_to(size_t position);
+    bool start_playback_stream();
     void draw_waveform(const Cairo::RefPtr<Cairo::Context>& cr);
     std::string format_time(double seconds);
 };
@@ -131,14 +224,30 @@ AudioApp::AudioApp()
       m_ButtonPlay(">"),
       m_ButtonStop("■"),
       m_ButtonRecord("●"),
+      m_SavedFormat(0),
       m_CurrentPosition(0),
       m_PlaybackPosition(0),
+      m_PlaybackEnd(0),
       m_IsPlaying(false),
       m_IsRecording(false),
+      m_ReduceCaptureNoise(false),
+      m_SeekRequest(kNoSeek),
+      m_SeekIssued(0),
+      m_SeekApplied(0),
+      m_Scrubbing(false),
+      m_ScrubRemaining(0),
+      m_ScrubGrain(0),
+      m_ScrubResume(false),
+      m_OutputLatency(0.0),
+      m_TickId(0),
       m_SampleRate(44100),
       m_Channels(2),
       m_Stream(nullptr),
-      m_UpdatingPositionScale(false)
+      m_UpdatingPositionScale(false),
+      m_Importer([this]() { m_ImportDispatcher.emit(); }),
+      m_ImportTarget(IMPORT_REPLACE),
+      m_ImportPosition(0),
+      m_LoadingRate(0)
 {
     set_title("Sound - Sound Recorder");
     set_default_size(400, 200);
@@ -161,14 +270,17 @@ AudioApp::AudioApp()
     item = Gtk::manage(new Gtk::MenuItem("Save"));
     item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_file_save));
     m_MenuFile.append(*item);
+    m_LoadingDisabled.push_back(item);
     
     item = Gtk::manage(new Gtk::MenuItem("Save As"));
     item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_file_saveas));
     m_MenuFile.append(*item);
+    m_LoadingDisabled.push_back(item);
     
     item = Gtk::manage(new Gtk::MenuItem("Revert"));
     item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_file_revert));
     m_MenuFile.append(*item);
+    m_LoadingDisabled.push_back(item);
     
     item = Gtk::manage(new Gtk::MenuItem("Properties"));
     item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_file_properties));
@@ -250,15 +362,76 @@ AudioApp::AudioApp()
     item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_effects_reverse));
     m_MenuEffects.append(*item);
     
+    m_MenuEffects.append(*Gtk::manage(new Gtk::SeparatorMenuItem()));
+    
+    item = Gtk::manage(new Gtk::MenuItem("Analyze Loudness"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_effects_analyze_loudness));
+    m_MenuEffects.append(*item);
+    
+    item = Gtk::manage(new Gtk::MenuItem("Normalize Loudness (to -23 LUFS)"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_effects_normalize_loudness));
+    m_MenuEffects.append(*item);
+    
+    item = Gtk::manage(new Gtk::MenuItem("Normalize Peak (to -1 dBTP)"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_effects_normalize_peak));
+    m_MenuEffects.append(*item);
+    
+    m_MenuEffects.append(*Gtk::manage(new Gtk::SeparatorMenuItem()));
+    
+    item = Gtk::manage(new Gtk::MenuItem("Learn Noise Profile (from Current Position)"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_effects_learn_noise));
+    m_MenuEffects.append(*item);
+    
+    item = Gtk::manage(new Gtk::MenuItem("Reduce Noise"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_effects_reduce_noise));
+    m_MenuEffects.append(*item);
+    
+    m_ReduceNoiseRecording = Gtk::manage(new Gtk::CheckMenuItem("Reduce Noise While Recording"));
+    m_ReduceNoiseRecording->signal_toggled().connect(sigc::mem_fun(*this, &AudioApp::on_menu_effects_reduce_noise_recording));
+    m_MenuEffects.append(*m_ReduceNoiseRecording);
+    
     m_MenuItemEffects.set_label("Effects");
     m_MenuItemEffects.set_submenu(m_MenuEffects);
     m_MenuBar.append(m_MenuItemEffects);
     
+    // Tracks Menu
+    item = Gtk::manage(new Gtk::MenuItem("Add Tracks From Files"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_tracks_add_file));
+    m_MenuTracks.append(*item);
+    
+    item = Gtk::manage(new Gtk::MenuItem("Move Recording to New Track"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_tracks_add_recording));
+    m_MenuTracks.append(*item);
+    
+    item = Gtk::manage(new Gtk::MenuItem("Track Mixer"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_tracks_mixer));
+    m_MenuTracks.append(*item);
+    
+    item = Gtk::manage(new Gtk::MenuItem("Remove All Tracks"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_tracks_clear));
+    m_MenuTracks.append(*item);
+    
+    m_MenuTracks.append(*Gtk::manage(new Gtk::SeparatorMenuItem()));
+    
+    item = Gtk::manage(new Gtk::MenuItem("Bounce Mix to File"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_tracks_bounce));
+    m_MenuTracks.append(*item);
+    
+    m_MenuItemTracks.set_label("Tracks");
+    m_MenuItemTracks.set_submenu(m_MenuTracks);
+    m_MenuBar.append(m_MenuItemTracks);
+    
     // Help Menu
     item = Gtk::manage(new Gtk::MenuItem("About"));
     item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_help_about));
     m_MenuHelp.append(*item);
     
+#ifdef MR_TRACING
+    item = Gtk::manage(new Gtk::MenuItem("Export Trace"));
+    item->signal_activate().connect(sigc::mem_fun(*this, &AudioApp::on_menu_help_export_trace));
+    m_MenuHelp.append(*item);
+#endif
+    
     m_MenuItemHelp.set_label("Help");
     m_MenuItemHelp.set_submenu(m_MenuHelp);
     m_MenuBar.append(m_MenuItemHelp);
@@ -316,6 +489,8 @@ AudioApp::AudioApp()
 	m_PositionScale->set_hexpand(true);
 	m_PositionScale->set_vexpand(false);
 	m_PositionScale->signal_value_changed().connect(sigc::mem_fun(*this, &AudioApp::on_position_scale_changed));
+	m_PositionScale->signal_button_press_event().connect(sigc::mem_fun(*this, &AudioApp::on_position_scale_pressed), false);
+	m_PositionScale->signal_button_release_event().connect(sigc::mem_fun(*this, &AudioApp::on_position_scale_released), false);
 	
 	// --- Controls row ---
 	m_ButtonRewind.signal_clicked().connect(sigc::mem_fun(*this, &AudioApp::on_button_rewind));
@@ -351,10 +526,27 @@ AudioApp::AudioApp()
 	// Row 4
 	m_VBox.pack_start(m_ControlBox, false, false, 0);
 
+	// Row 5, only shown while files are being decoded
+	m_ImportProgress.set_show_text(true);
+	m_VBox.pack_start(m_ImportProgress, false, false, 0);
+
+	// Nothing may play, record or edit the document while an opened
+	// file is decoding, since it is about to be replaced
+	m_LoadingDisabled.push_back(&m_MenuItemEdit);
+	m_LoadingDisabled.push_back(&m_MenuItemEffects);
+	m_LoadingDisabled.push_back(&m_MenuItemTracks);
+	m_LoadingDisabled.push_back(m_PositionScale);
+	m_LoadingDisabled.push_back(&m_ButtonRewind);
+	m_LoadingDisabled.push_back(&m_ButtonFastForward);
+	m_LoadingDisabled.push_back(&m_ButtonPlay);
+	m_LoadingDisabled.push_back(&m_ButtonRecord);
+
 	// Finally
 	add(m_VBox);
 	show_all_children();
+	m_ImportProgress.hide();
 
+	m_ImportDispatcher.connect(sigc::mem_fun(*this, &AudioApp::on_import_ready));
     
     m_TimerConnection = Glib::signal_timeout().connect(
         sigc::mem_fun(*this, &AudioApp::update_position), 50);
@@ -364,6 +556,13 @@ AudioApp::AudioApp()
 AudioApp::~AudioApp() {
     m_TimerConnection.disconnect();
     cleanup_audio();
+    
+#ifdef MR_TRACING
+    const std::string tracePath = trace::default_path();
+    if (trace::export_json(tracePath)) {
+        std::cerr << "Trace written to " << tracePath << std::endl;
+    }
+#endif
 }
 
 void AudioApp::init_audio() {
@@ -387,22 +586,70 @@ int AudioApp::paCallback(const void *inputBuffer, void *outputBuffer,
                         PaStreamCallbackFlags statusFlags,
                         void *userData)
 {
+    TRACE_THREAD_NAME("audio");
+    TRACE_SCOPE("AudioApp::paCallback");
     AudioApp *app = (AudioApp*)userData;
     float *out = (float*)outputBuffer;
     const float *in = (const float*)inputBuffer;
     
-    if (app->m_IsRecording && in) {
+    if (app->m_IsRecording && in && app->m_ReduceCaptureNoise) {
+        const size_t capacity = app->m_CaptureScratch.size() / app->m_Channels;
+        for (size_t done = 0; done < framesPerBuffer; ) {
+            const size_t frames = std::min(capacity, (size_t)framesPerBuffer - done);
+            const size_t written = app->m_CaptureNoise.process(in + done * app->m_Channels, frames,
+                                                               app->m_CaptureScratch.data());
+            app->m_AudioBuffer.insert(app->m_AudioBuffer.end(), app->m_CaptureScratch.begin(),
+                                      app->m_CaptureScratch.begin() + written * app->m_Channels);
+            done += frames;
+        }
+    } else if (app->m_IsRecording && in) {
         for (unsigned long i = 0; i < framesPerBuffer * app->m_Channels; i++) {
             app->m_AudioBuffer.push_back(in[i]);
         }
     }
     
     if (app->m_IsPlaying && out) {
-        for (unsigned long i = 0; i < framesPerBuffer * app->m_Channels; i++) {
-            if (app->m_PlaybackPosition < app->m_AudioBuffer.size()) {
-                out[i] = app->m_AudioBuffer[app->m_PlaybackPosition++];
-            } else {
-                out[i] = 0.0f;
+        const size_t total = framesPerBuffer * app->m_Channels;
+        const bool scrubbing = app->m_Scrubbing;
+        
+        const size_t seek = app->m_SeekRequest.exchange(kNoSeek);
+        unsigned generation = 0;
+        if (seek != kNoSeek) {
+            generation = app->m_SeekIssued;
+            app->m_PlaybackPosition = seek;
+            app->m_ScrubRemaining = app->m_ScrubGrain;
+        }
+        
+        // While scrubbing, each move of the scale plays one short grain
+        const size_t count = scrubbing ? std::min(total, app->m_ScrubRemaining) : total;
+        const size_t start = app->m_PlaybackPosition;
+        for (size_t i = 0; i < count; i++) {
+            out[i] = (start + i < app->m_AudioBuffer.size()) ? app->m_AudioBuffer[start + i] : 0.0f;
+        }
+        std::fill(out + count, out + total, 0.0f);
+        
+        // Tracks are summed on top of the document buffer
+        app->m_Session.mix(out, start / app->m_Channels, count / app->m_Channels);
+        
+        app->m_PlaybackPosition = start + count;
+        if (scrubbing) {
+            app->m_ScrubRemaining -= count;
+        } else {
+            // Stream time at which the first frame of this buffer is heard.
+            // Some host APIs leave the DAC time at zero.
+            double dacTime = timeInfo->outputBufferDacTime;
+            if (dacTime <= 0.0) {
+                dacTime = timeInfo->currentTime + app->m_OutputLatency;
+            }
+            app->m_Clock.publish(dacTime, start / app->m_Channels);
+        }
+        if (seek != kNoSeek) {
+            app->m_SeekApplied = generation;
+        }
+        
+        if (app->m_PlaybackPosition >= app->m_PlaybackEnd) {
+            app->m_PlaybackPosition = app->m_PlaybackEnd;
+            if (!scrubbing) {
                 app->m_IsPlaying = false;
             }
         }
@@ -419,6 +666,7 @@ bool AudioApp::on_waveform_draw(const Cairo::RefPtr<Cairo::Context>& cr) {
 }
 
 void AudioApp::draw_waveform(const Cairo::RefPtr<Cairo::Context>& cr) {
+    TRACE_SCOPE("AudioApp::draw_waveform");
     cr->save();
 
     auto allocation = m_WaveformArea.get_allocation();
@@ -431,28 +679,31 @@ void AudioApp::draw_waveform(const Cairo::RefPtr<Cairo::Context>& cr) {
     cr->set_source_rgb(0.0, 0.0, 0.0);
     cr->paint();
 
+    // The pyramid follows the buffer, growing incrementally while
+    // recording. While a file is still decoding, its overview from the
+    // peak cache is shown instead.
     if (!m_AudioBuffer.empty()) {
+        m_Peaks.extend(m_AudioBuffer.data(), m_AudioBuffer.size(), m_Channels);
+    } else {
+        m_Peaks.clear();
+    }
+    const PeakPyramid& peaks = m_LoadingPeaks.empty() ? m_Peaks : m_LoadingPeaks;
+
+    if (!peaks.empty()) {
         cr->set_source_rgb(0.0, 1.0, 0.0);
         cr->set_line_width(1.0);
 
         const int centerY = height / 2;
-        const size_t samplesPerPixel = std::max<size_t>(1, m_AudioBuffer.size() / std::max(1, width));
+        const size_t frames = peaks.frames();
 
         for (int x = 0; x < width; x++) {
-            size_t startSample = (size_t)x * samplesPerPixel;
-            size_t endSample = std::min(startSample + samplesPerPixel, m_AudioBuffer.size());
+            size_t startFrame = (size_t)x * frames / width;
+            size_t endFrame = (size_t)(x + 1) * frames / width;
 
-            float maxVal = 0.0f;
-            float minVal = 0.0f;
-
-            for (size_t i = startSample; i < endSample; i += m_Channels) {
-                float val = m_AudioBuffer[i];
-                maxVal = std::max(maxVal, val);
-                minVal = std::min(minVal, val);
-            }
+            Peak peak = peaks.range(startFrame, endFrame);
 
-            int y1 = centerY - (int)(maxVal * centerY * 0.9f);
-            int y2 = centerY - (int)(minVal * centerY * 0.9f);
+            int y1 = centerY - (int)(peak.max * centerY * 0.9f);
+            int y2 = centerY - (int)(peak.min * centerY * 0.9f);
 
             cr->move_to(x + 0.5, y1 + 0.5);
             cr->line_to(x + 0.5, y2 + 0.5);
@@ -464,12 +715,17 @@ void AudioApp::draw_waveform(const Cairo::RefPtr<Cairo::Context>& cr) {
 }
 
 bool AudioApp::update_position() {
-    if (m_IsPlaying) {
-        m_CurrentPosition = std::min(m_PlaybackPosition, m_AudioBuffer.size());
+    TRACE_SCOPE("AudioApp::update_position");
+    if (m_IsPlaying && m_TickId == 0) {
+        m_CurrentPosition = std::min(m_PlaybackPosition, session_length());
     } else if (m_IsRecording) {
         m_CurrentPosition = m_AudioBuffer.size();
     }
 
+    if (m_Importer.busy()) {
+        m_ImportProgress.set_fraction(m_Importer.progress());
+    }
+
     update_displays();
     m_WaveformArea.queue_draw();
     return true;
@@ -481,18 +737,103 @@ void AudioApp::on_position_scale_changed() {
     }
 
     const double positionSeconds = m_PositionScale->get_value();
-    size_t newPosition = static_cast<size_t>(positionSeconds * m_SampleRate * m_Channels);
-    newPosition = std::min(newPosition, m_AudioBuffer.size());
+    size_t newPosition = static_cast<size_t>(positionSeconds * m_SampleRate) * m_Channels;
+    newPosition = std::min(newPosition, session_length());
 
-    m_CurrentPosition = newPosition;
-    m_PlaybackPosition = newPosition;
+    seek_to(newPosition);
     update_displays();
 }
 
+bool AudioApp::on_position_scale_pressed(GdkEventButton* event) {
+    if (m_IsRecording || session_length() == 0) {
+        return false;
+    }
+
+    m_ScrubResume = m_IsPlaying;
+    m_ScrubGrain = (size_t)(m_SampleRate / 15) * m_Channels;
+    m_Scrubbing = true;
+
+    if (!m_IsPlaying) {
+        // Nothing is heard until the scale actually moves
+        m_PlaybackEnd = session_length();
+        m_PlaybackPosition = m_CurrentPosition;
+        m_ScrubRemaining = 0;
+        m_IsPlaying = true;
+        start_playback_stream();
+    }
+    return false;
+}
+
+bool AudioApp::on_position_scale_released(GdkEventButton* event) {
+    if (!m_Scrubbing) {
+        return false;
+    }
+
+    m_Scrubbing = false;
+    const size_t position = m_CurrentPosition;
+    if (m_ScrubResume) {
+        m_PlaybackEnd = session_length();
+        seek_to(position);
+    } else {
+        on_button_stop();
+        m_CurrentPosition = position;
+        m_PlaybackPosition = position;
+        update_displays();
+    }
+    return false;
+}
+
+bool AudioApp::on_playhead_tick(const Glib::RefPtr<Gdk::FrameClock>& clock) {
+    TRACE_SCOPE("AudioApp::on_playhead_tick");
+    if (!m_IsPlaying) {
+        // Ran off the end
+        m_CurrentPosition = std::min(m_PlaybackPosition, session_length());
+        update_displays();
+        m_TickId = 0;
+        return false;
+    }
+
+    if (!m_Scrubbing) {
+        m_CurrentPosition = playhead_position();
+        update_displays();
+    }
+    return true;
+}
+
+size_t AudioApp::playhead_position() {
+    // Until the callback has picked up the latest seek the clock describes
+    // the old position, so keep showing where we asked to go
+    if (!m_IsPlaying || !m_Stream || m_Scrubbing || m_SeekApplied != m_SeekIssued) {
+        return m_CurrentPosition;
+    }
+
+    double dacTime;
+    size_t frame;
+    m_Clock.read(dacTime, frame);
+
+    double audible = frame + (Pa_GetStreamTime(m_Stream) - dacTime) * m_SampleRate;
+    size_t position = (size_t)std::max(0.0, audible) * m_Channels;
+    return std::min(position, std::min((size_t)m_PlaybackPosition, m_PlaybackEnd));
+}
+
+void AudioApp::seek_to(size_t position) {
+    m_CurrentPosition = position;
+    if (m_IsPlaying) {
+        m_SeekIssued++;
+        m_SeekRequest = position;
+    } else {
+        m_PlaybackPosition = position;
+    }
+}
+
 void AudioApp::update_displays() {
     const double totalSamplesPerSecond = m_SampleRate * m_Channels;
     double posSeconds = totalSamplesPerSecond > 0 ? (double)m_CurrentPosition / totalSamplesPerSecond : 0.0;
-    double lenSeconds = totalSamplesPerSecond > 0 ? (double)m_AudioBuffer.size() / totalSamplesPerSecond : 0.0;
+    double lenSeconds = totalSamplesPerSecond > 0 ? (double)session_length() / totalSamplesPerSecond : 0.0;
+    if (!m_LoadingPeaks.empty()) {
+        posSeconds = 0.0;
+        lenSeconds = (double)m_LoadingPeaks.frames() / m_LoadingRate;
+    }
 
     m_PositionLabel.set_text(format_time(posSeconds));
     m_LengthLabel.set_text(format_time(lenSeconds));
@@ -503,6 +844,10 @@ void AudioApp::update_displays() {
     m_UpdatingPositionScale = false;
 }
 
+size_t AudioApp::session_length() const {
+    return std::max(m_AudioBuffer.size(), m_Session.length_frames() * m_Channels);
+}
+
 std::string AudioApp::format_time(double seconds) {
     char buffer[32];
     snprintf(buffer, sizeof(buffer), "%.2f sec", seconds);
@@ -511,9 +856,11 @@ std::string AudioApp::format_time(double seconds) {
 
 void AudioApp::on_menu_file_new() {
     m_AudioBuffer.clear();
+    m_Session.clear();
     m_CurrentPosition = 0;
     m_PlaybackPosition = 0;
     m_CurrentFile.clear();
+    document_changed();
     update_displays();
     m_WaveformArea.queue_draw();
 }
@@ -564,10 +911,20 @@ void AudioApp::on_menu_file_revert() {
 }
 
 void AudioApp::on_menu_file_properties() {
+    TRACE_SCOPE("AudioApp::on_menu_file_properties");
     Gtk::MessageDialog dialog(*this, "Audio Properties", false, Gtk::MESSAGE_INFO);
+    if (!m_AudioBuffer.empty() && !m_Peaks.has_stats()) {
+        m_Peaks.build(m_AudioBuffer.data(), m_AudioBuffer.size(), m_Channels);
+    }
+    
     char info[256];
-    snprintf(info, sizeof(info), "Sample Rate: %d Hz\nChannels: %d\nSamples: %zu",
-             m_SampleRate, m_Channels, m_AudioBuffer.size());
+    int length = snprintf(info, sizeof(info), "Sample Rate: %d Hz\nChannels: %d\nSamples: %zu",
+                          m_SampleRate, m_Channels, m_AudioBuffer.size());
+    if (m_Peaks.has_stats() && m_Peaks.stats().peak > 0.0f) {
+        snprintf(info + length, sizeof(info) - length, "\nPeak: %.1f dBFS\nRMS: %.1f dBFS",
+                 20.0 * std::log10(m_Peaks.stats().peak),
+                 20.0 * std::log10(std::max(m_Peaks.stats().rms, 1e-10f)));
+    }
     dialog.set_secondary_text(info);
     dialog.run();
 }
@@ -584,20 +941,24 @@ void AudioApp::on_menu_edit_copy() {
 }
 
 void AudioApp::on_menu_edit_paste_insert() {
+    TRACE_SCOPE("AudioApp::on_menu_edit_paste_insert");
     if (!m_ClipboardBuffer.empty() && m_CurrentPosition <= m_AudioBuffer.size()) {
         m_AudioBuffer.insert(m_AudioBuffer.begin() + m_CurrentPosition,
                             m_ClipboardBuffer.begin(), m_ClipboardBuffer.end());
+        document_changed();
         update_displays();
     }
 }
 
 void AudioApp::on_menu_edit_paste_mix() {
+    TRACE_SCOPE("AudioApp::on_menu_edit_paste_mix");
     if (!m_ClipboardBuffer.empty() && m_CurrentPosition < m_AudioBuffer.size()) {
         for (size_t i = 0; i < m_ClipboardBuffer.size() && 
              (m_CurrentPosition + i) < m_AudioBuffer.size(); i++) {
             m_AudioBuffer[m_CurrentPosition + i] = 
                 (m_AudioBuffer[m_CurrentPosition + i] + m_ClipboardBuffer[i]) * 0.5f;
         }
+        document_changed();
         update_displays();
     }
 }
@@ -605,23 +966,14 @@ void AudioApp::on_menu_edit_paste_mix() {
 void AudioApp::on_menu_edit_insert_file() {
     Gtk::FileChooserDialog dialog("Insert Audio File", Gtk::FILE_CHOOSER_ACTION_OPEN);
     dialog.set_transient_for(*this);
+    dialog.set_select_multiple(true);
     dialog.add_button("_Cancel", Gtk::RESPONSE_CANCEL);
     dialog.add_button("_Open", Gtk::RESPONSE_OK);
     
     int result = dialog.run();
     if (result == Gtk::RESPONSE_OK) {
-        std::vector<float> tempBuffer;
-        SF_INFO sfinfo;
-        SNDFILE* file = sf_open(dialog.get_filename().c_str(), SFM_READ, &sfinfo);
-        if (file) {
-            tempBuffer.resize(sfinfo.frames * sfinfo.channels);
-            sf_read_float(file, tempBuffer.data(), tempBuffer.size());
-            sf_close(file);
-            
-            m_AudioBuffer.insert(m_AudioBuffer.begin() + m_CurrentPosition,
-                                tempBuffer.begin(), tempBuffer.end());
-            update_displays();
-        }
+        m_ImportPosition = m_CurrentPosition;
+        start_import(dialog.get_filenames(), IMPORT_INSERT);
     }
 }
 
@@ -635,6 +987,7 @@ void AudioApp::on_menu_edit_delete_before() {
                            m_AudioBuffer.begin() + m_CurrentPosition);
         m_CurrentPosition = 0;
         m_PlaybackPosition = 0;
+        document_changed();
         update_displays();
     }
 }
@@ -643,6 +996,7 @@ void AudioApp::on_menu_edit_delete_after() {
     if (m_CurrentPosition < m_AudioBuffer.size()) {
         m_AudioBuffer.erase(m_AudioBuffer.begin() + m_CurrentPosition, 
                            m_AudioBuffer.end());
+        document_changed();
         update_displays();
     }
 }
@@ -652,21 +1006,26 @@ void AudioApp::on_menu_edit_audio_properties() {
 }
 
 void AudioApp::on_menu_effects_increase_volume() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_increase_volume");
     for (auto& sample : m_AudioBuffer) {
         sample *= 1.25f;
         sample = std::max(-1.0f, std::min(1.0f, sample));
     }
+    document_changed();
     m_WaveformArea.queue_draw();
 }
 
 void AudioApp::on_menu_effects_decrease_volume() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_decrease_volume");
     for (auto& sample : m_AudioBuffer) {
         sample *= 0.8f;
     }
+    document_changed();
     m_WaveformArea.queue_draw();
 }
 
 void AudioApp::on_menu_effects_increase_speed() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_increase_speed");
     std::vector<float> newBuffer;
     newBuffer.reserve(m_AudioBuffer.size() / 2);
     for (size_t i = 0; i < m_AudioBuffer.size(); i += 2 * m_Channels) {
@@ -675,10 +1034,12 @@ void AudioApp::on_menu_effects_increase_speed() {
         }
     }
     m_AudioBuffer = newBuffer;
+    document_changed();
     update_displays();
 }
 
 void AudioApp::on_menu_effects_decrease_speed() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_decrease_speed");
     std::vector<float> newBuffer;
     newBuffer.reserve(m_AudioBuffer.size() * 2);
     for (size_t i = 0; i < m_AudioBuffer.size(); i += m_Channels) {
@@ -688,10 +1049,12 @@ void AudioApp::on_menu_effects_decrease_speed() {
         }
     }
     m_AudioBuffer = newBuffer;
+    document_changed();
     update_displays();
 }
 
 void AudioApp::on_menu_effects_add_echo() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_add_echo");
     int echoDelay = m_SampleRate / 2;
     std::vector<float> newBuffer = m_AudioBuffer;
     
@@ -700,70 +1063,390 @@ void AudioApp::on_menu_effects_add_echo() {
         newBuffer[i] = std::max(-1.0f, std::min(1.0f, newBuffer[i]));
     }
     m_AudioBuffer = newBuffer;
+    document_changed();
     m_WaveformArea.queue_draw();
 }
 
 void AudioApp::on_menu_effects_reverse() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_reverse");
     std::reverse(m_AudioBuffer.begin(), m_AudioBuffer.end());
+    document_changed();
     m_WaveformArea.queue_draw();
 }
 
+// Measured once per version of the document. While the buffer still
+// matches its file the result goes into the peak cache as well, so a
+// reopened file is not measured again.
+LoudnessStats AudioApp::document_loudness() {
+    if (m_Peaks.has_loudness() && m_Peaks.frames() * m_Channels == m_AudioBuffer.size()) {
+        return m_Peaks.loudness();
+    }
+    
+    LoudnessStats stats = measure_loudness(m_AudioBuffer.data(), m_AudioBuffer.size(),
+                                           m_Channels, m_SampleRate);
+    if (!m_Peaks.has_stats() || m_Peaks.frames() * m_Channels != m_AudioBuffer.size()) {
+        m_Peaks.build(m_AudioBuffer.data(), m_AudioBuffer.size(), m_Channels);
+    }
+    m_Peaks.set_loudness(stats);
+    if (!m_SavedFile.empty()) {
+        peak_cache_save(m_SavedFile, m_Peaks, m_SampleRate, m_SavedFormat);
+    }
+    return stats;
+}
+
+void AudioApp::on_menu_effects_analyze_loudness() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_analyze_loudness");
+    if (m_AudioBuffer.empty()) return;
+    
+    LoudnessStats stats = document_loudness();
+    
+    Gtk::MessageDialog dialog(*this, "Loudness", false, Gtk::MESSAGE_INFO);
+    char info[256];
+    snprintf(info, sizeof(info),
+             "Integrated: %.1f LUFS\nTrue Peak: %.1f dBTP\nSample Peak: %.1f dBFS\nRMS: %.1f dBFS",
+             stats.integrated, 20.0 * std::log10(stats.truePeak),
+             20.0 * std::log10(stats.samplePeak), 20.0 * std::log10(stats.rms));
+    std::string text = info;
+    if (!loudness_layout_supported(m_Channels)) {
+        text += "\n\nBS.1770 does not define this channel layout, so all channels "
+                "were weighted equally.";
+    }
+    dialog.set_secondary_text(text);
+    dialog.run();
+}
+
+void AudioApp::on_menu_effects_normalize_loudness() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_normalize_loudness");
+    if (m_AudioBuffer.empty()) return;
+    
+    if (!loudness_layout_supported(m_Channels)) {
+        Gtk::MessageDialog dialog(*this, "Cannot normalize this channel layout", false, Gtk::MESSAGE_WARNING);
+        dialog.set_secondary_text("Loudness normalization supports mono, stereo and 5.0/5.1 audio.");
+        dialog.run();
+        return;
+    }
+    
+    LoudnessStats stats = document_loudness();
+    if (!std::isfinite(stats.integrated)) {
+        Gtk::MessageDialog dialog(*this, "Audio is too quiet to measure", false, Gtk::MESSAGE_WARNING);
+        dialog.run();
+        return;
+    }
+    
+    bool limited;
+    double gainDb = loudness_gain_db(stats, kTargetLoudness, kTruePeakCeiling, limited);
+    apply_gain(m_AudioBuffer.data(), m_AudioBuffer.size(), (float)std::pow(10.0, gainDb / 20.0));
+    document_changed();
+    m_WaveformArea.queue_draw();
+    
+    if (limited) {
+        Gtk::MessageDialog dialog(*this, "Normalization limited by true peak", false, Gtk::MESSAGE_INFO);
+        char info[128];
+        snprintf(info, sizeof(info), "Reached %.1f LUFS with peaks at %.1f dBTP.",
+                 stats.integrated + gainDb, kTruePeakCeiling);
+        dialog.set_secondary_text(info);
+        dialog.run();
+    }
+}
+
+void AudioApp::on_menu_effects_normalize_peak() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_normalize_peak");
+    if (m_AudioBuffer.empty()) return;
+    
+    LoudnessStats stats = document_loudness();
+    if (stats.truePeak <= 0.0) return;
+    
+    double gainDb = kTruePeakCeiling - 20.0 * std::log10(stats.truePeak);
+    apply_gain(m_AudioBuffer.data(), m_AudioBuffer.size(), (float)std::pow(10.0, gainDb / 20.0));
+    document_changed();
+    m_WaveformArea.queue_draw();
+}
+
+void AudioApp::on_menu_effects_learn_noise() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_learn_noise");
+    // There is no selection, so like the other edits this works from the
+    // current position: the next few seconds should hold only the noise.
+    size_t start = std::min(m_CurrentPosition, m_AudioBuffer.size());
+    start -= start % m_Channels;
+    const size_t length = std::min(m_AudioBuffer.size() - start,
+                                   (size_t)(kNoiseProfileSeconds * m_SampleRate) * m_Channels);
+    
+    NoiseProfile profile = learn_noise_profile(m_AudioBuffer.data() + start, length,
+                                               m_Channels, m_SampleRate);
+    if (profile.empty()) {
+        Gtk::MessageDialog dialog(*this, "Not enough audio to learn the noise from", false, Gtk::MESSAGE_WARNING);
+        char info[128];
+        snprintf(info, sizeof(info), "Move to a stretch of at least %.2f seconds that holds only the noise.",
+                 (double)noise_profile_min_frames() / m_SampleRate);
+        dialog.set_secondary_text(info);
+        dialog.run();
+        return;
+    }
+    m_NoiseProfile = profile;
+}
+
+void AudioApp::on_menu_effects_reduce_noise() {
+    TRACE_SCOPE("AudioApp::on_menu_effects_reduce_noise");
+    if (m_AudioBuffer.empty()) return;
+    
+    if (m_NoiseProfile.empty() || m_NoiseProfile.sampleRate != m_SampleRate) {
+        Gtk::MessageDialog dialog(*this, "Learn a noise profile first", false, Gtk::MESSAGE_WARNING);
+        dialog.set_secondary_text("Move to a stretch of noise and use Learn Noise Profile.");
+        dialog.run();
+        return;
+    }
+    
+    m_AudioBuffer = reduce_noise(m_AudioBuffer, m_Channels, m_NoiseProfile, kNoiseReductionDb);
+    document_changed();
+    m_WaveformArea.queue_draw();
+}
+
+void AudioApp::on_menu_effects_reduce_noise_recording() {
+    if (m_ReduceNoiseRecording->get_active()
+        && (m_NoiseProfile.empty() || m_NoiseProfile.sampleRate != m_SampleRate)) {
+        m_ReduceNoiseRecording->set_active(false);
+        Gtk::MessageDialog dialog(*this, "Learn a noise profile first", false, Gtk::MESSAGE_WARNING);
+        dialog.set_secondary_text("Move to a stretch of noise and use Learn Noise Profile.");
+        dialog.run();
+    }
+}
+
+void AudioApp::on_menu_tracks_add_file() {
+    Gtk::FileChooserDialog dialog("Add Tracks From Files", Gtk::FILE_CHOOSER_ACTION_OPEN);
+    dialog.set_transient_for(*this);
+    dialog.set_select_multiple(true);
+    dialog.add_button("_Cancel", Gtk::RESPONSE_CANCEL);
+    dialog.add_button("_Open", Gtk::RESPONSE_OK);
+
+    int result = dialog.run();
+    if (result == Gtk::RESPONSE_OK) {
+        start_import(dialog.get_filenames(), IMPORT_TRACKS);
+    }
+}
+
+void AudioApp::on_menu_tracks_add_recording() {
+    if (m_AudioBuffer.empty() || m_IsRecording) return;
+
+    char name[32];
+    snprintf(name, sizeof(name), "Take %zu", m_Session.track_count() + 1);
+    m_Session.add_track(name, std::move(m_AudioBuffer), m_Channels, m_SampleRate);
+
+    m_AudioBuffer.clear();
+    document_changed();
+    update_displays();
+    m_WaveformArea.queue_draw();
+}
+
+void AudioApp::on_menu_tracks_mixer() {
+    Gtk::Dialog dialog("Track Mixer", *this, true);
+    dialog.add_button("_Close", Gtk::RESPONSE_CLOSE);
+
+    Gtk::Grid grid;
+    grid.set_row_spacing(5);
+    grid.set_column_spacing(10);
+    grid.set_border_width(5);
+
+    grid.attach(*Gtk::manage(new Gtk::Label("Track")), 0, 0, 1, 1);
+    grid.attach(*Gtk::manage(new Gtk::Label("Mute")), 1, 0, 1, 1);
+    grid.attach(*Gtk::manage(new Gtk::Label("Gain")), 2, 0, 1, 1);
+    grid.attach(*Gtk::manage(new Gtk::Label("Pan")), 3, 0, 1, 1);
+    grid.attach(*Gtk::manage(new Gtk::Label("Offset (sec)")), 4, 0, 1, 1);
+
+    // Parameters are atomics on the track, so edits are heard immediately
+    // even while playing.
+    for (size_t i = 0; i < m_Session.track_count(); i++) {
+        Track* track = &m_Session.track(i);
+        const int row = (int)i + 1;
+
+        auto label = Gtk::manage(new Gtk::Label(track->name));
+        label->set_halign(Gtk::ALIGN_START);
+        grid.attach(*label, 0, row, 1, 1);
+
+        auto mute = Gtk::manage(new Gtk::CheckButton());
+        mute->set_active(track->mute);
+        mute->signal_toggled().connect([track, mute]() {
+            track->mute = mute->get_active();
+        });
+        grid.attach(*mute, 1, row, 1, 1);
+
+        auto gain = Gtk::manage(new Gtk::Scale(Gtk::ORIENTATION_HORIZONTAL));
+        gain->set_range(0.0, 2.0);
+        gain->set_value(track->gain);
+        gain->set_size_request(120, -1);
+        gain->signal_value_changed().connect([track, gain]() {
+            track->gain = (float)gain->get_value();
+        });
+        grid.attach(*gain, 2, row, 1, 1);
+
+        auto pan = Gtk::manage(new Gtk::Scale(Gtk::ORIENTATION_HORIZONTAL));
+        pan->set_range(-1.0, 1.0);
+        pan->set_value(track->pan);
+        pan->set_size_request(120, -1);
+        pan->set_sensitive(m_Channels == 2);
+        pan->signal_value_changed().connect([track, pan]() {
+            track->pan = (float)pan->get_value();
+        });
+        grid.attach(*pan, 3, row, 1, 1);
+
+        auto offset = Gtk::manage(new Gtk::SpinButton(0.01, 2));
+        offset->set_range(0.0, 36000.0);
+        offset->set_increments(0.1, 1.0);
+        offset->set_value((double)track->offset / m_SampleRate);
+        const int sampleRate = m_SampleRate;
+        offset->signal_value_changed().connect([this, track, offset, sampleRate]() {
+            track->offset = (size_t)(offset->get_value() * sampleRate);
+            update_displays();
+        });
+        grid.attach(*offset, 4, row, 1, 1);
+    }
+
+    if (m_Session.track_count() == 0) {
+        grid.attach(*Gtk::manage(new Gtk::Label("No tracks in session")), 0, 1, 5, 1);
+    }
+
+    dialog.get_content_area()->pack_start(grid, true, true, 0);
+    dialog.show_all_children();
+    dialog.run();
+}
+
+void AudioApp::on_menu_tracks_clear() {
+    m_Session.clear();
+    m_CurrentPosition = std::min(m_CurrentPosition, session_length());
+    update_displays();
+}
+
+void AudioApp::on_menu_tracks_bounce() {
+    TRACE_SCOPE("AudioApp::on_menu_tracks_bounce");
+    Gtk::FileChooserDialog dialog("Bounce Mix to File", Gtk::FILE_CHOOSER_ACTION_SAVE);
+    dialog.set_transient_for(*this);
+    dialog.add_button("_Cancel", Gtk::RESPONSE_CANCEL);
+    dialog.add_button("_Save", Gtk::RESPONSE_OK);
+
+    int result = dialog.run();
+    if (result == Gtk::RESPONSE_OK) {
+        if (!m_Session.bounce(dialog.get_filename(), SF_FORMAT_WAV | SF_FORMAT_PCM_16,
+                              m_AudioBuffer)) {
+            Gtk::MessageDialog error(*this, "Error saving file", false, Gtk::MESSAGE_ERROR);
+            error.run();
+        }
+    }
+}
+
 void AudioApp::on_menu_help_about() {
     Gtk::MessageDialog dialog(*this, "About Sound Recorder");
     dialog.set_secondary_text("GTK3 Audio Recording and Mixing Application\nVersion 1.0");
     dialog.run();
 }
 
+#ifdef MR_TRACING
+void AudioApp::on_menu_help_export_trace() {
+    const std::string path = trace::default_path();
+    bool ok = trace::export_json(path);
+    
+    Gtk::MessageDialog dialog(*this, ok ? "Trace exported" : "Error exporting trace", false,
+                              ok ? Gtk::MESSAGE_INFO : Gtk::MESSAGE_ERROR);
+    dialog.set_secondary_text(path);
+    dialog.run();
+}
+#endif
+
 void AudioApp::on_button_rewind() {
-    m_PlaybackPosition = 0;
-    m_CurrentPosition = 0;
+    seek_to(0);
     update_displays();
 }
 
 void AudioApp::on_button_fast_forward() {
-    m_PlaybackPosition = m_AudioBuffer.size();
-    m_CurrentPosition = m_AudioBuffer.size();
+    seek_to(session_length());
     update_displays();
 }
 
 void AudioApp::on_button_play() {
-    if (m_AudioBuffer.empty()) return;
-    m_PlaybackPosition = std::min(m_CurrentPosition, m_AudioBuffer.size());
-    m_IsPlaying = true;
+    m_PlaybackEnd = session_length();
+    if (m_PlaybackEnd == 0) return;
     m_IsRecording = false;
     
+    // Go through the seek path so the playhead ignores the clock left
+    // over from the last time we played
+    m_SeekIssued++;
+    m_SeekRequest = std::min(m_CurrentPosition, m_PlaybackEnd);
+    m_IsPlaying = true;
+    
+    start_playback_stream();
+}
+
+bool AudioApp::start_playback_stream() {
+    // The stream may still be open from the last play, but a format change
+    // since then has dropped the bus. prepare() takes the session lock and
+    // the callback only try-locks it, so this is safe either way.
+    m_Session.prepare(kFramesPerBuffer);
+    
     if (!m_Stream) {
         PaError err = Pa_OpenDefaultStream(&m_Stream, 0, m_Channels, paFloat32,
-                                          m_SampleRate, 256, paCallback, this);
-        if (err == paNoError) {
-            Pa_StartStream(m_Stream);
+                                          m_SampleRate, kFramesPerBuffer, paCallback, this);
+        if (err != paNoError) {
+            m_Stream = nullptr;
+            return false;
         }
+        const PaStreamInfo* info = Pa_GetStreamInfo(m_Stream);
+        m_OutputLatency = info ? info->outputLatency : 0.0;
+        Pa_StartStream(m_Stream);
+    }
+    
+    if (m_TickId == 0) {
+        m_TickId = add_tick_callback(sigc::mem_fun(*this, &AudioApp::on_playhead_tick));
     }
+    return true;
 }
 
 void AudioApp::on_button_stop() {
+    // Stop where the audio actually was, not where the callback had
+    // rendered up to
+    size_t position = m_IsPlaying ? playhead_position() : m_PlaybackPosition;
     m_IsPlaying = false;
     m_IsRecording = false;
-    m_CurrentPosition = std::min(m_PlaybackPosition, m_AudioBuffer.size());
+    m_CurrentPosition = std::min(position, session_length());
+    if (m_TickId) {
+        remove_tick_callback(m_TickId);
+        m_TickId = 0;
+    }
     if (m_Stream) {
         Pa_StopStream(m_Stream);
         Pa_CloseStream(m_Stream);
         m_Stream = nullptr;
     }
+    
+    // The callback has stopped, so collect what the reducer still holds
+    if (m_ReduceCaptureNoise) {
+        std::vector<float> tail(m_CaptureNoise.latency() * m_Channels);
+        const size_t frames = m_CaptureNoise.finish(tail.data());
+        m_AudioBuffer.insert(m_AudioBuffer.end(), tail.begin(), tail.begin() + frames * m_Channels);
+        m_ReduceCaptureNoise = false;
+    }
     update_displays();
 }
 
 void AudioApp::on_button_record() {
+    // Set up the capture reducer before the callback can see it
+    if (!m_Stream) {
+        m_ReduceCaptureNoise = m_ReduceNoiseRecording->get_active()
+            && !m_NoiseProfile.empty() && m_NoiseProfile.sampleRate == m_SampleRate;
+        if (m_ReduceCaptureNoise) {
+            m_CaptureNoise.configure(m_NoiseProfile, m_Channels, kNoiseReductionDb);
+            m_CaptureScratch.resize(kFramesPerBuffer * m_Channels);
+        }
+    }
+    
     m_IsRecording = true;
     m_IsPlaying = false;
     m_AudioBuffer.clear();
     m_CurrentPosition = 0;
     m_PlaybackPosition = 0;
+    document_changed();
     update_displays();
 
     if (!m_Stream) {
         PaError err = Pa_OpenDefaultStream(&m_Stream, m_Channels, 0, paFloat32,
-                                          m_SampleRate, 256, paCallback, this);
+                                          m_SampleRate, kFramesPerBuffer, paCallback, this);
         if (err == paNoError) {
             Pa_StartStream(m_Stream);
         }
@@ -771,30 +1454,142 @@ void AudioApp::on_button_record() {
 }
 
 void AudioApp::load_audio_file(const std::string& filename) {
-    SF_INFO sfinfo;
-    SNDFILE* file = sf_open(filename.c_str(), SFM_READ, &sfinfo);
+    TRACE_SCOPE("AudioApp::load_audio_file");
+    if (!start_import(std::vector<std::string>(1, filename), IMPORT_REPLACE)) {
+        return;
+    }
+    if (m_Stream) {
+        on_button_stop();
+    }
+    set_loading(filename);
     
-    if (!file) {
-        Gtk::MessageDialog dialog(*this, "Error opening file", false, Gtk::MESSAGE_ERROR);
+    // A cache hit paints the whole overview and length right away, while
+    // the samples themselves are still being decoded
+    int format;
+    if (!peak_cache_load(filename, m_LoadingPeaks, m_LoadingRate, format)) {
+        m_LoadingPeaks.clear();
+    }
+    
+    update_displays();
+    m_WaveformArea.queue_draw();
+}
+
+// Everything that would play, edit, write or reload the document is
+// disabled until the replacement has been decoded, or has failed to.
+void AudioApp::set_loading(const std::string& filename) {
+    m_LoadingFile = filename;
+    if (filename.empty()) {
+        m_LoadingPeaks.clear();
+    }
+    for (Gtk::Widget* widget : m_LoadingDisabled) {
+        widget->set_sensitive(filename.empty());
+    }
+}
+
+// Called after every edit of the buffer
+void AudioApp::document_changed() {
+    m_Peaks.clear();
+    m_SavedFile.clear();
+}
+
+bool AudioApp::start_import(const std::vector<std::string>& files, ImportTarget target) {
+    if (m_Importer.busy()) {
+        Gtk::MessageDialog dialog(*this, "Files are still being imported", false, Gtk::MESSAGE_WARNING);
         dialog.run();
-        return;
+        return false;
     }
     
-    m_SampleRate = sfinfo.samplerate;
-    m_Channels = sfinfo.channels;
-    m_AudioBuffer.resize(sfinfo.frames * sfinfo.channels);
+    // Opening keeps the file's own format; everything else is converted
+    // to the document format on the workers.
+    bool started;
+    if (target == IMPORT_REPLACE) {
+        started = m_Importer.start(files, 0, 0, true);
+    } else {
+        started = m_Importer.start(files, m_Channels, m_SampleRate, target == IMPORT_INSERT);
+    }
+    if (!started) {
+        return false;
+    }
     
-    sf_read_float(file, m_AudioBuffer.data(), m_AudioBuffer.size());
-    sf_close(file);
+    m_ImportTarget = target;
+    m_ImportFailures.clear();
+    m_ImportProgress.set_fraction(0.0);
+    m_ImportProgress.set_text(files.size() == 1 ? "Loading..." : "Importing files...");
+    m_ImportProgress.show();
+    return true;
+}
+
+void AudioApp::on_import_ready() {
+    TRACE_SCOPE("AudioApp::on_import_ready");
+    std::vector<ImportResult> results = m_Importer.take_ready();
+    
+    for (auto& result : results) {
+        if (!result.ok) {
+            m_ImportFailures.push_back(Glib::path_get_basename(result.filename));
+            continue;
+        }
+        
+        switch (m_ImportTarget) {
+        case IMPORT_REPLACE:
+            m_SampleRate = result.sampleRate;
+            m_Channels = result.channels;
+            m_Session.set_format(m_Channels, m_SampleRate);
+            m_AudioBuffer.swap(result.samples);
+            m_CurrentFile = m_LoadingFile;
+            m_SavedFile = m_LoadingFile;
+            m_SavedFormat = result.format;
+            m_CurrentPosition = 0;
+            m_PlaybackPosition = 0;
+            
+            m_Peaks = m_LoadingPeaks;
+            if (m_Peaks.channels() != m_Channels || !m_Peaks.has_stats()
+                || m_Peaks.frames() * m_Channels != m_AudioBuffer.size()) {
+                m_Peaks.build(m_AudioBuffer.data(), m_AudioBuffer.size(), m_Channels);
+                peak_cache_save(result.filename, m_Peaks, m_SampleRate, result.format);
+            }
+            break;
+        case IMPORT_INSERT: {
+            // Files are handed back in selection order, each one going
+            // after the previous
+            size_t position = std::min(m_ImportPosition, m_AudioBuffer.size());
+            m_AudioBuffer.insert(m_AudioBuffer.begin() + position,
+                                result.samples.begin(), result.samples.end());
+            m_ImportPosition = position + result.samples.size();
+            document_changed();
+            break;
+        }
+        case IMPORT_TRACKS:
+            m_Session.add_track(Glib::path_get_basename(result.filename), std::move(result.samples),
+                                result.channels, result.sampleRate);
+            break;
+        }
+    }
+    
+    if (m_Importer.busy()) {
+        m_ImportProgress.set_fraction(m_Importer.progress());
+    } else {
+        if (m_ImportTarget == IMPORT_REPLACE) {
+            set_loading(std::string());
+        }
+        m_ImportProgress.hide();
+        if (!m_ImportFailures.empty()) {
+            std::string names;
+            for (const auto& name : m_ImportFailures) {
+                names += name + "\n";
+            }
+            m_ImportFailures.clear();
+            Gtk::MessageDialog dialog(*this, "Error opening file", false, Gtk::MESSAGE_ERROR);
+            dialog.set_secondary_text(names);
+            dialog.run();
+        }
+    }
     
-    m_CurrentFile = filename;
-    m_CurrentPosition = 0;
-    m_PlaybackPosition = 0;
     update_displays();
     m_WaveformArea.queue_draw();
 }
 
 void AudioApp::save_audio_file(const std::string& filename) {
+    TRACE_SCOPE("AudioApp::save_audio_file");
     SF_INFO sfinfo;
     sfinfo.samplerate = m_SampleRate;
     sfinfo.channels = m_Channels;
@@ -810,9 +1605,20 @@ void AudioApp::save_audio_file(const std::string& filename) {
     
     sf_write_float(file, m_AudioBuffer.data(), m_AudioBuffer.size());
     sf_close(file);
+    m_SavedFile = filename;
+    m_SavedFormat = sfinfo.format;
+    
+    if (!m_AudioBuffer.empty()) {
+        if (!m_Peaks.has_stats()) {
+            m_Peaks.build(m_AudioBuffer.data(), m_AudioBuffer.size(), m_Channels);
+        }
+        peak_cache_save(filename, m_Peaks, m_SampleRate, sfinfo.format);
+    }
 }
 
 int main(int argc, char* argv[]) {
+    TRACE_THREAD_NAME("main");
+    
     // Suppress ALSA error messages
     snd_lib_error_set_handler(alsa_error_handler);
     
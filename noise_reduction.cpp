@@ -0,0 +1,490 @@
+#include "noise_reduction.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+namespace {
+
+const size_t kFftSize = 2048;
+const size_t kOverlap = 4;
+const size_t kHop = kFftSize / kOverlap;
+const size_t kPad = kFftSize - kHop;        // frame f starts at sample f * kHop - kPad
+const size_t kBins = kFftSize / 2 + 1;
+const size_t kHopsPerTask = 1024;           // about 10 s of audio per task
+
+const float kThreshold = 3.0f;              // gate opens ~10 dB above the noise
+const double kReleaseSeconds = 0.1;
+const double kWarmupResidual = 1e-6;
+
+std::vector<float> hann_window() {
+    std::vector<float> window(kFftSize);
+    for (size_t n = 0; n < kFftSize; n++) {
+        window[n] = (float)(0.5 - 0.5 * std::cos(2.0 * M_PI * n / kFftSize));
+    }
+    return window;
+}
+
+// Real FFT of kFftSize points, computed as a complex FFT of half that
+// size on split real/imaginary arrays.
+class RealFft {
+public:
+    RealFft();
+
+    // in has kFftSize samples, re and im get kBins bins, zr and zi are
+    // kFftSize / 2 of scratch.
+    void forward(const float* in, float* zr, float* zi, float* re, float* im) const;
+
+    // The inverse, scaled so that inverse(forward(x)) == x.
+    void inverse(const float* re, const float* im, float* zr, float* zi, float* out) const;
+
+private:
+    void transform(float* zr, float* zi, float sign) const;
+
+    std::vector<size_t> m_Reverse;
+    std::vector<float> m_Cos;
+    std::vector<float> m_Sin;
+    std::vector<float> m_SplitCos;   // twiddles of the full size, for splitting
+    std::vector<float> m_SplitSin;
+};
+
+RealFft::RealFft() {
+    const size_t n = kFftSize / 2;
+    size_t bits = 0;
+    while (((size_t)1 << bits) < n) {
+        bits++;
+    }
+
+    m_Reverse.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        size_t reversed = 0;
+        for (size_t b = 0; b < bits; b++) {
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        m_Reverse[i] = reversed;
+    }
+
+    m_Cos.resize(n / 2);
+    m_Sin.resize(n / 2);
+    for (size_t k = 0; k < n / 2; k++) {
+        m_Cos[k] = (float)std::cos(2.0 * M_PI * k / n);
+        m_Sin[k] = (float)std::sin(2.0 * M_PI * k / n);
+    }
+
+    m_SplitCos.resize(n + 1);
+    m_SplitSin.resize(n + 1);
+    for (size_t k = 0; k <= n; k++) {
+        m_SplitCos[k] = (float)std::cos(2.0 * M_PI * k / kFftSize);
+        m_SplitSin[k] = (float)std::sin(2.0 * M_PI * k / kFftSize);
+    }
+}
+
+// In-place radix-2 transform; sign is -1 for forward, +1 for inverse
+void RealFft::transform(float* zr, float* zi, float sign) const {
+    const size_t n = m_Reverse.size();
+    for (size_t i = 0; i < n; i++) {
+        const size_t j = m_Reverse[i];
+        if (i < j) {
+            std::swap(zr[i], zr[j]);
+            std::swap(zi[i], zi[j]);
+        }
+    }
+
+    for (size_t len = 2; len <= n; len <<= 1) {
+        const size_t half = len / 2;
+        const size_t step = n / len;
+        for (size_t i = 0; i < n; i += len) {
+            for (size_t j = 0; j < half; j++) {
+                const float wr = m_Cos[j * step];
+                const float wi = sign * m_Sin[j * step];
+                const size_t a = i + j;
+                const size_t b = a + half;
+                const float xr = zr[b] * wr - zi[b] * wi;
+                const float xi = zr[b] * wi + zi[b] * wr;
+                zr[b] = zr[a] - xr;
+                zi[b] = zi[a] - xi;
+                zr[a] += xr;
+                zi[a] += xi;
+            }
+        }
+    }
+}
+
+void RealFft::forward(const float* in, float* zr, float* zi, float* re, float* im) const {
+    const size_t n = kFftSize / 2;
+    for (size_t i = 0; i < n; i++) {
+        zr[i] = in[2 * i];
+        zi[i] = in[2 * i + 1];
+    }
+    transform(zr, zi, -1.0f);
+
+    // Separate the spectra of the even and odd samples, then combine them
+    for (size_t k = 0; k <= n; k++) {
+        const size_t a = k % n;
+        const size_t b = (n - k) % n;
+        const float evenRe = 0.5f * (zr[a] + zr[b]);
+        const float evenIm = 0.5f * (zi[a] - zi[b]);
+        const float oddRe = 0.5f * (zi[a] + zi[b]);
+        const float oddIm = -0.5f * (zr[a] - zr[b]);
+        const float c = m_SplitCos[k];
+        const float s = m_SplitSin[k];
+        re[k] = evenRe + c * oddRe + s * oddIm;
+        im[k] = evenIm + c * oddIm - s * oddRe;
+    }
+}
+
+void RealFft::inverse(const float* re, const float* im, float* zr, float* zi, float* out) const {
+    const size_t n = kFftSize / 2;
+    for (size_t k = 0; k < n; k++) {
+        const size_t b = n - k;
+        const float evenRe = 0.5f * (re[k] + re[b]);
+        const float evenIm = 0.5f * (im[k] - im[b]);
+        const float diffRe = 0.5f * (re[k] - re[b]);
+        const float diffIm = 0.5f * (im[k] + im[b]);
+        const float c = m_SplitCos[k];
+        const float s = m_SplitSin[k];
+        const float oddRe = diffRe * c - diffIm * s;
+        const float oddIm = diffRe * s + diffIm * c;
+        zr[k] = evenRe - oddIm;
+        zi[k] = evenIm + oddRe;
+    }
+    transform(zr, zi, 1.0f);
+
+    const float scale = 1.0f / n;
+    for (size_t i = 0; i < n; i++) {
+        out[2 * i] = zr[i] * scale;
+        out[2 * i + 1] = zi[i] * scale;
+    }
+}
+
+// gains[k] follows 1 where |X[k]|^2 > threshold[k], else floor. It opens
+// at once and closes at the release rate: max(raw, prev + a * (raw - prev)).
+void update_gains(const float* re, const float* im, const float* threshold,
+                  float* gains, float floor, float release)
+{
+    size_t k = 0;
+#if defined(__SSE__)
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 closed = _mm_set1_ps(floor);
+    const __m128 rate = _mm_set1_ps(release);
+    for (; k + 4 <= kBins; k += 4) {
+        const __m128 r = _mm_loadu_ps(re + k);
+        const __m128 i = _mm_loadu_ps(im + k);
+        const __m128 power = _mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(i, i));
+        const __m128 open = _mm_cmpgt_ps(power, _mm_loadu_ps(threshold + k));
+        const __m128 raw = _mm_or_ps(_mm_and_ps(open, one), _mm_andnot_ps(open, closed));
+        const __m128 prev = _mm_loadu_ps(gains + k);
+        const __m128 next = _mm_add_ps(prev, _mm_mul_ps(rate, _mm_sub_ps(raw, prev)));
+        _mm_storeu_ps(gains + k, _mm_max_ps(raw, next));
+    }
+#endif
+    for (; k < kBins; k++) {
+        const float power = re[k] * re[k] + im[k] * im[k];
+        const float raw = power > threshold[k] ? 1.0f : floor;
+        gains[k] = std::max(raw, gains[k] + release * (raw - gains[k]));
+    }
+}
+
+// Blurs the gains over neighbouring bins (1/4, 1/2, 1/4) and applies them
+void apply_gains(const float* gains, float* re, float* im) {
+    const size_t last = kBins - 1;
+    float edge = 0.75f * gains[0] + 0.25f * gains[1];
+    re[0] *= edge;
+    im[0] *= edge;
+
+    size_t k = 1;
+#if defined(__SSE__)
+    const __m128 quarter = _mm_set1_ps(0.25f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    for (; k + 4 <= last; k += 4) {
+        const __m128 sides = _mm_add_ps(_mm_loadu_ps(gains + k - 1), _mm_loadu_ps(gains + k + 1));
+        const __m128 g = _mm_add_ps(_mm_mul_ps(half, _mm_loadu_ps(gains + k)),
+                                    _mm_mul_ps(quarter, sides));
+        _mm_storeu_ps(re + k, _mm_mul_ps(_mm_loadu_ps(re + k), g));
+        _mm_storeu_ps(im + k, _mm_mul_ps(_mm_loadu_ps(im + k), g));
+    }
+#endif
+    for (; k < last; k++) {
+        const float g = 0.5f * gains[k] + 0.25f * (gains[k - 1] + gains[k + 1]);
+        re[k] *= g;
+        im[k] *= g;
+    }
+
+    edge = 0.75f * gains[last] + 0.25f * gains[last - 1];
+    re[last] *= edge;
+    im[last] *= edge;
+}
+
+// Copies the kFftSize samples of frame f for one channel, with silence
+// outside the audio
+void read_frame(const float* samples, size_t frames, int channels, int channel,
+                size_t frame, float* out)
+{
+    const ptrdiff_t start = (ptrdiff_t)(frame * kHop) - (ptrdiff_t)kPad;
+    for (size_t n = 0; n < kFftSize; n++) {
+        const ptrdiff_t s = start + (ptrdiff_t)n;
+        out[n] = (s >= 0 && (size_t)s < frames) ? samples[s * channels + channel] : 0.0f;
+    }
+}
+
+}
+
+// Everything derived from one profile and setting, shared by the batch
+// and streaming paths. Const once built, so tasks can share one.
+class SpectralGate {
+public:
+    SpectralGate(const NoiseProfile& profile, float reductionDb);
+
+    size_t scratch_size() const { return 2 * kFftSize + 3 * kBins; }
+    size_t warmup_frames() const { return m_Warmup; }
+    float initial_gain() const { return m_Floor; }
+
+    // Analyses one frame of kFftSize samples and updates the smoothed
+    // gains. With an output, the gated frame is overlap-added into it.
+    void process(const float* frame, float* gains, float* scratch, float* output) const;
+
+private:
+    RealFft m_Fft;
+    std::vector<float> m_Window;
+    std::vector<float> m_Synthesis;   // window scaled for unity overlap-add
+    std::vector<float> m_Threshold;   // squared magnitude, per bin
+    float m_Floor;
+    float m_Release;
+    size_t m_Warmup;
+};
+
+SpectralGate::SpectralGate(const NoiseProfile& profile, float reductionDb)
+    : m_Window(hann_window()),
+      m_Synthesis(kFftSize),
+      m_Threshold(kBins),
+      m_Floor((float)std::pow(10.0, -reductionDb / 20.0))
+{
+    double sum = 0.0;
+    for (size_t k = 0; k < kOverlap; k++) {
+        sum += (double)m_Window[k * kHop] * m_Window[k * kHop];
+    }
+    for (size_t n = 0; n < kFftSize; n++) {
+        m_Synthesis[n] = (float)(m_Window[n] / sum);
+    }
+
+    for (size_t k = 0; k < kBins && k < profile.magnitude.size(); k++) {
+        const float level = kThreshold * profile.magnitude[k];
+        m_Threshold[k] = level * level;
+    }
+
+    // Chunks start from closed gains, so run the smoothing that many
+    // frames ahead of the chunk; by then any difference from a single
+    // pass has decayed below kWarmupResidual.
+    const double release = 1.0 - std::exp(-(double)kHop / (std::max(profile.sampleRate, 1) * kReleaseSeconds));
+    m_Release = (float)release;
+    m_Warmup = release < 1.0
+        ? (size_t)std::ceil(std::log(kWarmupResidual) / std::log(1.0 - release))
+        : 0;
+}
+
+void SpectralGate::process(const float* frame, float* gains, float* scratch, float* output) const {
+    float* time = scratch;
+    float* zr = time + kFftSize;
+    float* zi = zr + kFftSize / 2;
+    float* re = zi + kFftSize / 2;
+    float* im = re + kBins;
+
+    for (size_t n = 0; n < kFftSize; n++) {
+        time[n] = frame[n] * m_Window[n];
+    }
+    m_Fft.forward(time, zr, zi, re, im);
+    update_gains(re, im, m_Threshold.data(), gains, m_Floor, m_Release);
+    if (!output) {
+        return;
+    }
+
+    apply_gains(gains, re, im);
+    m_Fft.inverse(re, im, zr, zi, time);
+    for (size_t n = 0; n < kFftSize; n++) {
+        output[n] += time[n] * m_Synthesis[n];
+    }
+}
+
+size_t noise_profile_min_frames() {
+    return kFftSize;
+}
+
+NoiseProfile learn_noise_profile(const float* samples, size_t count,
+                                 int channels, int sampleRate)
+{
+    TRACE_SCOPE("learn_noise_profile");
+    NoiseProfile profile;
+    if (channels <= 0 || count / channels < kFftSize) {
+        return profile;
+    }
+
+    const size_t frames = count / channels;
+    const RealFft fft;
+    const std::vector<float> window = hann_window();
+    std::vector<float> time(kFftSize), zr(kFftSize / 2), zi(kFftSize / 2), re(kBins), im(kBins);
+    std::vector<double> sum(kBins, 0.0);
+    size_t analysed = 0;
+
+    for (size_t start = 0; start + kFftSize <= frames; start += kHop) {
+        for (int c = 0; c < channels; c++) {
+            for (size_t n = 0; n < kFftSize; n++) {
+                time[n] = samples[(start + n) * channels + c] * window[n];
+            }
+            fft.forward(time.data(), zr.data(), zi.data(), re.data(), im.data());
+            for (size_t k = 0; k < kBins; k++) {
+                sum[k] += std::sqrt((double)re[k] * re[k] + (double)im[k] * im[k]);
+            }
+            analysed++;
+        }
+    }
+
+    profile.sampleRate = sampleRate;
+    profile.magnitude.resize(kBins);
+    for (size_t k = 0; k < kBins; k++) {
+        profile.magnitude[k] = (float)(sum[k] / analysed);
+    }
+    return profile;
+}
+
+std::vector<float> reduce_noise(const std::vector<float>& samples, int channels,
+                                const NoiseProfile& profile, float reductionDb)
+{
+    TRACE_SCOPE("reduce_noise");
+    if (channels <= 0 || profile.empty() || samples.size() < (size_t)channels) {
+        return samples;
+    }
+
+    const size_t frames = samples.size() / channels;
+    const SpectralGate gate(profile, reductionDb);
+    std::vector<float> output(samples.size());
+
+    // Task t owns the output hops [first, last). Those samples are covered
+    // by frames first .. last + kOverlap - 2, so neighbouring tasks both
+    // compute the few frames that straddle their seam.
+    const size_t hops = (frames + kHop - 1) / kHop;
+    const size_t tasks = (hops + kHopsPerTask - 1) / kHopsPerTask;
+    const float* in = samples.data();
+    float* out = output.data();
+
+    WorkerPool::shared().parallel_for(tasks, [&](size_t task) {
+        const size_t first = task * kHopsPerTask;
+        const size_t last = std::min(first + kHopsPerTask, hops);
+        const size_t end = last + kOverlap - 1;
+        const size_t warmup = std::min(first, gate.warmup_frames());
+
+        std::vector<float> frame(kFftSize);
+        std::vector<float> gains(kBins);
+        std::vector<float> scratch(gate.scratch_size());
+        std::vector<float> overlap((end - first - 1) * kHop + kFftSize);
+
+        const size_t begin = first * kHop;
+        const size_t stop = std::min(last * kHop, frames);
+
+        for (int c = 0; c < channels; c++) {
+            std::fill(gains.begin(), gains.end(), gate.initial_gain());
+            std::fill(overlap.begin(), overlap.end(), 0.0f);
+
+            for (size_t f = first - warmup; f < end; f++) {
+                read_frame(in, frames, channels, c, f, frame.data());
+                float* target = f >= first ? &overlap[(f - first) * kHop] : nullptr;
+                gate.process(frame.data(), gains.data(), scratch.data(), target);
+            }
+
+            // overlap[0] lines up with sample begin - kPad
+            for (size_t s = begin; s < stop; s++) {
+                out[s * channels + c] = overlap[s - begin + kPad];
+            }
+        }
+    });
+
+    // A trailing partial frame is passed through
+    std::copy(samples.begin() + frames * channels, samples.end(), output.begin() + frames * channels);
+    return output;
+}
+
+NoiseReducer::NoiseReducer()
+    : m_Channels(0),
+      m_Fill(0),
+      m_Delay(0)
+{
+}
+
+NoiseReducer::~NoiseReducer() {
+}
+
+void NoiseReducer::configure(const NoiseProfile& profile, int channels, float reductionDb) {
+    m_Gate.reset(new SpectralGate(profile, reductionDb));
+    m_Channels = channels;
+    m_Input.resize(channels * kFftSize);
+    m_Overlap.resize(channels * kFftSize);
+    m_Ready.resize(channels * kHop);
+    m_Gains.resize(channels * kBins);
+    m_Scratch.resize(m_Gate->scratch_size());
+    reset();
+}
+
+void NoiseReducer::reset() {
+    std::fill(m_Input.begin(), m_Input.end(), 0.0f);
+    std::fill(m_Overlap.begin(), m_Overlap.end(), 0.0f);
+    std::fill(m_Ready.begin(), m_Ready.end(), 0.0f);
+    std::fill(m_Gains.begin(), m_Gains.end(), m_Gate ? m_Gate->initial_gain() : 1.0f);
+    m_Fill = 0;
+    m_Delay = kFftSize;
+}
+
+size_t NoiseReducer::latency() const {
+    return kFftSize;
+}
+
+size_t NoiseReducer::process(const float* in, size_t frames, float* out) {
+    if (!m_Gate) {
+        if (in && out != in) {
+            std::copy(in, in + frames * m_Channels, out);
+        }
+        return in ? frames : 0;
+    }
+
+    // Each hop of input completes one frame, whose first hop of output is
+    // then final; it is played out over the next hop of input.
+    size_t written = 0;
+    for (size_t f = 0; f < frames; f++) {
+        for (int c = 0; c < m_Channels; c++) {
+            m_Input[c * kFftSize + kPad + m_Fill] = in ? in[f * m_Channels + c] : 0.0f;
+        }
+
+        if (m_Delay > 0) {
+            m_Delay--;
+        } else {
+            for (int c = 0; c < m_Channels; c++) {
+                out[written * m_Channels + c] = m_Ready[c * kHop + m_Fill];
+            }
+            written++;
+        }
+
+        if (++m_Fill < kHop) {
+            continue;
+        }
+        m_Fill = 0;
+
+        for (int c = 0; c < m_Channels; c++) {
+            float* input = &m_Input[c * kFftSize];
+            float* overlap = &m_Overlap[c * kFftSize];
+            m_Gate->process(input, &m_Gains[c * kBins], m_Scratch.data(), overlap);
+
+            std::copy(overlap, overlap + kHop, &m_Ready[c * kHop]);
+            std::copy(overlap + kHop, overlap + kFftSize, overlap);
+            std::fill(overlap + kPad, overlap + kFftSize, 0.0f);
+            std::copy(input + kHop, input + kFftSize, input);
+        }
+    }
+    return written;
+}
+
+size_t NoiseReducer::finish(float* out) {
+    return process(nullptr, kFftSize, out);
+}
@@ -0,0 +1,74 @@
+#ifndef NOISE_REDUCTION_H
+#define NOISE_REDUCTION_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Spectral-gating noise reduction. The audio is analysed in overlapping
+// STFT frames; bins that do not rise clearly above the learned noise
+// spectrum are attenuated by the reduction amount. Gains open at once,
+// close smoothly and are blurred across neighbouring bins, which keeps
+// the "musical noise" of a hard gate down.
+
+// Mean magnitude spectrum of a stretch of audio holding only the noise,
+// averaged over channels. Only valid at the sample rate it was learned at.
+struct NoiseProfile {
+    NoiseProfile() : sampleRate(0) {}
+
+    bool empty() const { return magnitude.empty(); }
+
+    int sampleRate;
+    std::vector<float> magnitude;
+};
+
+// Shortest stretch, in frames, that learn_noise_profile() can use.
+size_t noise_profile_min_frames();
+
+// Learns a profile from interleaved samples. The profile stays empty if
+// there are fewer than noise_profile_min_frames() frames.
+NoiseProfile learn_noise_profile(const float* samples, size_t count,
+                                 int channels, int sampleRate);
+
+// Returns a noise-reduced copy of interleaved samples. The frames are
+// split into chunks on the worker pool; each chunk also processes the
+// frames overlapping its edges, so the seams match a single pass.
+std::vector<float> reduce_noise(const std::vector<float>& samples, int channels,
+                                const NoiseProfile& profile, float reductionDb);
+
+class SpectralGate;
+
+// The same processing for a live stream, e.g. while recording. Output is
+// delayed by latency() frames internally and trimmed, so it lines up with
+// the input; finish() returns the delayed tail.
+class NoiseReducer {
+public:
+    NoiseReducer();
+    ~NoiseReducer();
+
+    // Allocates everything process() needs; call before the stream starts.
+    void configure(const NoiseProfile& profile, int channels, float reductionDb);
+    void reset();
+
+    // Real-time safe. Reads frames interleaved frames from in and writes
+    // up to as many to out (which may alias in); returns how many.
+    size_t process(const float* in, size_t frames, float* out);
+
+    // Writes the last latency() frames to out after the input has ended.
+    size_t finish(float* out);
+
+    size_t latency() const;
+
+private:
+    std::unique_ptr<SpectralGate> m_Gate;
+    std::vector<float> m_Input;     // last frame of input, per channel
+    std::vector<float> m_Overlap;   // overlap-add accumulator, per channel
+    std::vector<float> m_Ready;     // completed output, per channel
+    std::vector<float> m_Gains;     // smoothed gains, per channel
+    std::vector<float> m_Scratch;
+    int m_Channels;
+    size_t m_Fill;
+    size_t m_Delay;
+};
+
+#endif
@@ -0,0 +1,266 @@
+#include "peak_cache.h"
+#include "peaks.h"
+#include "trace.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kMagic[8] = { 'M', 'R', 'P', 'E', 'A', 'K', 'S', '\0' };
+const uint32_t kVersion = 3;
+
+// On-disk layout: header, the source path padded to 8 bytes, one uint64
+// Peak count per level, then the levels back to back.
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t channels;
+    uint32_t sampleRate;
+    uint32_t format;
+    uint64_t frames;
+    uint64_t sourceSize;
+    int64_t sourceMtimeSec;
+    int64_t sourceMtimeNsec;
+    float peak;
+    float rms;
+    uint32_t levelCount;
+    uint32_t pathLength;
+    uint32_t hasLoudness;
+    uint32_t reserved;
+    double integrated;         // LoudnessStats, when hasLoudness is set
+    double truePeak;
+    double samplePeak;
+    double loudnessRms;
+};
+
+size_t padded(size_t length) {
+    return (length + 7) & ~(size_t)7;
+}
+
+bool real_path(const std::string& path, std::string& resolved) {
+    char buffer[PATH_MAX];
+    if (!realpath(path.c_str(), buffer)) {
+        return false;
+    }
+    resolved = buffer;
+    return true;
+}
+
+std::string cache_dir() {
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    std::string base;
+    if (xdg && xdg[0] == '/') {
+        base = xdg;
+    } else {
+        const char* home = getenv("HOME");
+        base = std::string(home ? home : "/tmp") + "/.cache";
+    }
+    return base + "/mate-recorder/peaks";
+}
+
+bool make_dirs(const std::string& path) {
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        std::string part = path.substr(0, slash);
+        if (mkdir(part.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        if (slash == std::string::npos) {
+            return true;
+        }
+    }
+}
+
+// FNV-1a, so entry names stay the same across builds
+std::string cache_file(const std::string& resolved) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : resolved) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.peaks", (unsigned long long)hash);
+    return cache_dir() + "/" + name;
+}
+
+// Whole base buckets, then each level half the one below (rounded up)
+// until a single peak is left, exactly as PeakPyramid::build() lays it out
+bool level_sizes_match(uint64_t frames, const uint64_t* counts, uint32_t levelCount) {
+    uint64_t expected = (frames + PeakPyramid::kBaseFrames - 1) / PeakPyramid::kBaseFrames;
+    for (uint32_t i = 0; i < levelCount; i++) {
+        if (counts[i] != expected || (expected == 1) != (i + 1 == levelCount)) {
+            return false;
+        }
+        expected = (expected + 1) / 2;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+}
+
+bool peak_cache_load(const std::string& audioPath, PeakPyramid& peaks,
+                     int& sampleRate, int& format)
+{
+    TRACE_SCOPE("peak_cache_load");
+    std::string resolved;
+    struct stat source;
+    if (!real_path(audioPath, resolved) || stat(resolved.c_str(), &source) != 0) {
+        return false;
+    }
+
+    int fd = open(cache_file(resolved).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    const size_t size = info.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    const char* data = (const char*)mapping;
+    const CacheHeader* header = (const CacheHeader*)data;
+    bool ok = memcmp(header->magic, kMagic, sizeof(kMagic)) == 0
+        && header->version == kVersion
+        && header->channels > 0
+        && header->sourceSize == (uint64_t)source.st_size
+        && header->sourceMtimeSec == (int64_t)source.st_mtim.tv_sec
+        && header->sourceMtimeNsec == (int64_t)source.st_mtim.tv_nsec
+        && header->pathLength == resolved.size();
+
+    size_t offset = sizeof(CacheHeader);
+    ok = ok && offset + padded(header->pathLength) <= size
+        && memcmp(data + offset, resolved.data(), resolved.size()) == 0;
+    offset += padded(header->pathLength);
+
+    const uint64_t* counts = (const uint64_t*)(data + offset);
+    offset += header->levelCount * sizeof(uint64_t);
+    ok = ok && header->levelCount > 0 && offset <= size
+        && level_sizes_match(header->frames, counts, header->levelCount);
+
+    std::vector<std::vector<Peak>> levels;
+    for (uint32_t i = 0; ok && i < header->levelCount; i++) {
+        const size_t bytes = counts[i] * sizeof(Peak);
+        if (counts[i] > size || offset + bytes > size) {
+            ok = false;
+            break;
+        }
+        const Peak* first = (const Peak*)(data + offset);
+        levels.push_back(std::vector<Peak>(first, first + counts[i]));
+        offset += bytes;
+    }
+
+    if (ok) {
+        AudioStats stats;
+        stats.peak = header->peak;
+        stats.rms = header->rms;
+        sampleRate = header->sampleRate;
+        format = header->format;
+        peaks.assign(header->channels, header->frames, levels, stats);
+        if (header->hasLoudness) {
+            LoudnessStats loudness;
+            loudness.integrated = header->integrated;
+            loudness.truePeak = header->truePeak;
+            loudness.samplePeak = header->samplePeak;
+            loudness.rms = header->loudnessRms;
+            peaks.set_loudness(loudness);
+        }
+    }
+
+    munmap(mapping, size);
+    return ok;
+}
+
+bool peak_cache_save(const std::string& audioPath, const PeakPyramid& peaks,
+                     int sampleRate, int format)
+{
+    TRACE_SCOPE("peak_cache_save");
+    std::string resolved;
+    struct stat source;
+    if (peaks.empty() || !peaks.has_stats() || !real_path(audioPath, resolved)
+        || stat(resolved.c_str(), &source) != 0 || !make_dirs(cache_dir())) {
+        return false;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.channels = peaks.channels();
+    header.sampleRate = sampleRate;
+    header.format = format;
+    header.frames = peaks.frames();
+    header.sourceSize = source.st_size;
+    header.sourceMtimeSec = source.st_mtim.tv_sec;
+    header.sourceMtimeNsec = source.st_mtim.tv_nsec;
+    header.peak = peaks.stats().peak;
+    header.rms = peaks.stats().rms;
+    header.levelCount = peaks.level_count();
+    header.pathLength = resolved.size();
+    if (peaks.has_loudness()) {
+        header.hasLoudness = 1;
+        header.integrated = peaks.loudness().integrated;
+        header.truePeak = peaks.loudness().truePeak;
+        header.samplePeak = peaks.loudness().samplePeak;
+        header.loudnessRms = peaks.loudness().rms;
+    }
+
+    // Write to a temporary and rename, so a reader never maps a torn file
+    const std::string target = cache_file(resolved);
+    std::string temp = target + ".XXXXXX";
+    int fd = mkstemp(&temp[0]);
+    if (fd < 0) {
+        return false;
+    }
+
+    std::string path = resolved;
+    path.resize(padded(resolved.size()), '\0');
+    bool ok = write_all(fd, &header, sizeof(header))
+        && write_all(fd, path.data(), path.size());
+
+    for (size_t i = 0; ok && i < peaks.level_count(); i++) {
+        uint64_t count = peaks.level(i).size();
+        ok = write_all(fd, &count, sizeof(count));
+    }
+    for (size_t i = 0; ok && i < peaks.level_count(); i++) {
+        ok = write_all(fd, peaks.level(i).data(), peaks.level(i).size() * sizeof(Peak));
+    }
+
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temp.c_str(), target.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
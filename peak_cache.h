@@ -0,0 +1,22 @@
+#ifndef PEAK_CACHE_H
+#define PEAK_CACHE_H
+
+#include <string>
+
+class PeakPyramid;
+
+// Persistent overview cache kept under $XDG_CACHE_HOME/mate-recorder/peaks.
+// Entries are keyed by the audio file's real path and are only used while
+// the file's size and modification time still match.
+
+// Map the cache entry for audioPath and fill peaks (including its stats,
+// and its loudness if that was measured) and the file's format. Returns
+// false on a miss or a stale entry.
+bool peak_cache_load(const std::string& audioPath, PeakPyramid& peaks,
+                     int& sampleRate, int& format);
+
+// Write an entry for audioPath describing its current contents.
+bool peak_cache_save(const std::string& audioPath, const PeakPyramid& peaks,
+                     int sampleRate, int format);
+
+#endif
@@ -0,0 +1,183 @@
+#include "peaks.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const size_t kBucketsPerTask = 4096;
+
+inline void merge(Peak& into, const Peak& other) {
+    into.min = std::min(into.min, other.min);
+    into.max = std::max(into.max, other.max);
+}
+
+}
+
+PeakPyramid::PeakPyramid()
+    : m_Frames(0),
+      m_Channels(0),
+      m_HasStats(false),
+      m_HasLoudness(false)
+{
+    m_Stats.peak = 0.0f;
+    m_Stats.rms = 0.0f;
+}
+
+void PeakPyramid::clear() {
+    m_Levels.clear();
+    m_Frames = 0;
+    m_HasStats = false;
+    m_HasLoudness = false;
+}
+
+void PeakPyramid::set_loudness(const LoudnessStats& loudness) {
+    m_Loudness = loudness;
+    m_HasLoudness = true;
+}
+
+void PeakPyramid::compute_base(const float* samples, size_t count,
+                               size_t fromBucket, size_t toBucket)
+{
+    std::vector<Peak>& base = m_Levels[0];
+    const size_t channels = m_Channels;
+
+    for (size_t b = fromBucket; b < toBucket; b++) {
+        const size_t begin = b * kBaseFrames * channels;
+        const size_t end = std::min(begin + kBaseFrames * channels, count);
+
+        // Start from silence, like the original per-pixel scan, so the
+        // overview always straddles the centre line.
+        Peak peak = { 0.0f, 0.0f };
+        for (size_t i = begin; i < end; i++) {
+            peak.min = std::min(peak.min, samples[i]);
+            peak.max = std::max(peak.max, samples[i]);
+        }
+        base[b] = peak;
+    }
+}
+
+void PeakPyramid::rebuild_levels(size_t fromBucket) {
+    size_t level = 1;
+    size_t from = fromBucket;
+
+    while (m_Levels[level - 1].size() > 1) {
+        if (m_Levels.size() <= level) {
+            m_Levels.push_back(std::vector<Peak>());
+        }
+        const std::vector<Peak>& child = m_Levels[level - 1];
+        std::vector<Peak>& parent = m_Levels[level];
+
+        from /= 2;
+        parent.resize((child.size() + 1) / 2);
+        for (size_t i = from; i < parent.size(); i++) {
+            Peak peak = child[2 * i];
+            if (2 * i + 1 < child.size()) {
+                merge(peak, child[2 * i + 1]);
+            }
+            parent[i] = peak;
+        }
+        level++;
+    }
+
+    m_Levels.resize(level);
+}
+
+void PeakPyramid::build(const float* samples, size_t count, int channels) {
+    TRACE_SCOPE("PeakPyramid::build");
+    clear();
+    m_Channels = channels;
+    if (channels <= 0 || count < (size_t)channels) {
+        return;
+    }
+
+    m_Frames = count / channels;
+    const size_t buckets = (m_Frames + kBaseFrames - 1) / kBaseFrames;
+    m_Levels.resize(1);
+    m_Levels[0].resize(buckets);
+
+    const size_t tasks = (buckets + kBucketsPerTask - 1) / kBucketsPerTask;
+    std::vector<double> sumSquares(tasks, 0.0);
+    const size_t usable = m_Frames * channels;
+
+    WorkerPool::shared().parallel_for(tasks, [&](size_t task) {
+        const size_t fromBucket = task * kBucketsPerTask;
+        const size_t toBucket = std::min(fromBucket + kBucketsPerTask, buckets);
+        compute_base(samples, usable, fromBucket, toBucket);
+
+        const size_t begin = fromBucket * kBaseFrames * channels;
+        const size_t end = std::min(toBucket * kBaseFrames * channels, usable);
+        double sum = 0.0;
+        for (size_t i = begin; i < end; i++) {
+            sum += (double)samples[i] * samples[i];
+        }
+        sumSquares[task] = sum;
+    });
+
+    rebuild_levels(0);
+
+    const Peak& top = m_Levels.back()[0];
+    double total = 0.0;
+    for (double sum : sumSquares) {
+        total += sum;
+    }
+    m_Stats.peak = std::max(-top.min, top.max);
+    m_Stats.rms = (float)std::sqrt(total / usable);
+    m_HasStats = true;
+}
+
+void PeakPyramid::extend(const float* samples, size_t count, int channels) {
+    const size_t frames = channels > 0 ? count / channels : 0;
+    if (empty() || channels != m_Channels || frames < m_Frames) {
+        build(samples, count, channels);
+        return;
+    }
+    if (frames == m_Frames) {
+        return;
+    }
+
+    // The last bucket may have been partial, so start again from it
+    const size_t fromBucket = m_Frames / kBaseFrames;
+    const size_t buckets = (frames + kBaseFrames - 1) / kBaseFrames;
+
+    m_Frames = frames;
+    m_Levels[0].resize(buckets);
+    compute_base(samples, frames * channels, fromBucket, buckets);
+    rebuild_levels(fromBucket);
+    m_HasStats = false;
+    m_HasLoudness = false;
+}
+
+Peak PeakPyramid::range(size_t begin, size_t end) const {
+    Peak peak = { 0.0f, 0.0f };
+    if (empty() || begin >= m_Frames) {
+        return peak;
+    }
+    end = std::max(begin + 1, std::min(end, m_Frames));
+
+    size_t level = 0;
+    while (level + 1 < m_Levels.size() && (kBaseFrames << (level + 1)) <= end - begin) {
+        level++;
+    }
+
+    const size_t bucketFrames = kBaseFrames << level;
+    const std::vector<Peak>& peaks = m_Levels[level];
+    const size_t last = std::min((end - 1) / bucketFrames, peaks.size() - 1);
+    for (size_t i = begin / bucketFrames; i <= last; i++) {
+        merge(peak, peaks[i]);
+    }
+    return peak;
+}
+
+void PeakPyramid::assign(int channels, size_t frames, std::vector<std::vector<Peak>>& levels,
+                         const AudioStats& stats)
+{
+    m_Levels.swap(levels);
+    m_Channels = channels;
+    m_Frames = frames;
+    m_Stats = stats;
+    m_HasStats = true;
+    m_HasLoudness = false;
+}
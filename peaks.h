@@ -0,0 +1,74 @@
+#ifndef PEAKS_H
+#define PEAKS_H
+
+#include "loudness.h"
+
+#include <cstddef>
+#include <vector>
+
+struct Peak {
+    float min;
+    float max;
+};
+
+struct AudioStats {
+    float peak;  // largest absolute sample
+    float rms;   // over all channels
+};
+
+// Min/max overview of a buffer for drawing. Level 0 holds one Peak per
+// kBaseFrames frames (over all channels), and each level above halves
+// the one below, so any zoom can be drawn from roughly one Peak per pixel.
+class PeakPyramid {
+public:
+    static const size_t kBaseFrames = 256;
+
+    PeakPyramid();
+
+    void clear();
+    bool empty() const { return m_Levels.empty(); }
+    size_t frames() const { return m_Frames; }
+    int channels() const { return m_Channels; }
+
+    // Full rebuild, split across the worker pool. Also measures stats.
+    void build(const float* samples, size_t count, int channels);
+
+    // Bring the pyramid up to date with a buffer that has only grown
+    // since the last call, as during recording. Anything else rebuilds.
+    // Stats are dropped, since they would need another full pass.
+    void extend(const float* samples, size_t count, int channels);
+
+    // Min/max over frames [begin, end), read from the coarsest level
+    // that still resolves the range.
+    Peak range(size_t begin, size_t end) const;
+
+    bool has_stats() const { return m_HasStats; }
+    const AudioStats& stats() const { return m_Stats; }
+
+    // Loudness is measured separately and attached here so it is cached
+    // with the overview. It is dropped whenever the pyramid changes.
+    bool has_loudness() const { return m_HasLoudness; }
+    const LoudnessStats& loudness() const { return m_Loudness; }
+    void set_loudness(const LoudnessStats& loudness);
+
+    size_t level_count() const { return m_Levels.size(); }
+    const std::vector<Peak>& level(size_t index) const { return m_Levels[index]; }
+
+    // Install a pyramid read back from the peak cache.
+    void assign(int channels, size_t frames, std::vector<std::vector<Peak>>& levels,
+                const AudioStats& stats);
+
+private:
+    void compute_base(const float* samples, size_t count, size_t fromBucket, size_t toBucket);
+    void rebuild_levels(size_t fromBucket);
+
+    std::vector<std::vector<Peak>> m_Levels;
+    size_t m_Frames;
+    int m_Channels;
+    bool m_HasStats;
+    AudioStats m_Stats;
+    bool m_HasLoudness;
+    LoudnessStats m_Loudness;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef PLAYBACK_CLOCK_H
+#define PLAYBACK_CLOCK_H
+
+#include <atomic>
+#include <cstddef>
+
+// Ties stream time to the audio position. The audio callback publishes,
+// for each buffer, the stream time at which its first frame reaches the
+// DAC; the GUI reads the latest pair and extrapolates with
+// Pa_GetStreamTime. A sequence counter makes the pair consistent without
+// a lock: there is exactly one writer, and readers retry while it writes.
+class PlaybackClock {
+public:
+    PlaybackClock() : m_Sequence(0), m_Time(0.0), m_Frame(0) {}
+
+    // Audio thread only
+    void publish(double dacTime, size_t frame) {
+        const unsigned sequence = m_Sequence.load(std::memory_order_relaxed);
+        m_Sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_Time.store(dacTime, std::memory_order_relaxed);
+        m_Frame.store(frame, std::memory_order_relaxed);
+        m_Sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    void read(double& dacTime, size_t& frame) const {
+        for (;;) {
+            const unsigned sequence = m_Sequence.load(std::memory_order_acquire);
+            if (sequence & 1) {
+                continue;
+            }
+            dacTime = m_Time.load(std::memory_order_relaxed);
+            frame = m_Frame.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_Sequence.load(std::memory_order_relaxed) == sequence) {
+                return;
+            }
+        }
+    }
+
+private:
+    std::atomic<unsigned> m_Sequence;
+    std::atomic<double> m_Time;
+    std::atomic<size_t> m_Frame;
+};
+
+#endif
@@ -0,0 +1,239 @@
+#include "session.h"
+#include "audio_convert.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <sndfile.h>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+namespace {
+
+const size_t kBounceChunkFrames = 65536;
+
+// dst[i] += src[i] * gain, where the gain alternates gainL/gainR. Callers
+// pass equal gains for anything but stereo, so the alternation is only
+// visible when it matters and the vector path works for any layout.
+void add_scaled(float* dst, const float* src, size_t count, float gainL, float gainR) {
+    size_t i = 0;
+#if defined(__SSE__)
+    const __m128 gains = _mm_setr_ps(gainL, gainR, gainL, gainR);
+    for (; i + 8 <= count; i += 8) {
+        __m128 d0 = _mm_loadu_ps(dst + i);
+        __m128 d1 = _mm_loadu_ps(dst + i + 4);
+        d0 = _mm_add_ps(d0, _mm_mul_ps(_mm_loadu_ps(src + i), gains));
+        d1 = _mm_add_ps(d1, _mm_mul_ps(_mm_loadu_ps(src + i + 4), gains));
+        _mm_storeu_ps(dst + i, d0);
+        _mm_storeu_ps(dst + i + 4, d1);
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] += src[i] * ((i & 1) ? gainR : gainL);
+    }
+}
+
+// out[i] = clamp(out[i] + bus[i], -1, 1)
+void add_clamped(float* out, const float* bus, size_t count) {
+    size_t i = 0;
+#if defined(__SSE__)
+    const __m128 lo = _mm_set1_ps(-1.0f);
+    const __m128 hi = _mm_set1_ps(1.0f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 v = _mm_add_ps(_mm_loadu_ps(out + i), _mm_loadu_ps(bus + i));
+        _mm_storeu_ps(out + i, _mm_min_ps(_mm_max_ps(v, lo), hi));
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = std::max(-1.0f, std::min(1.0f, out[i] + bus[i]));
+    }
+}
+
+}
+
+Track::Track()
+    : gain(1.0f),
+      pan(0.0f),
+      mute(false),
+      offset(0)
+{
+}
+
+Session::Session()
+    : m_Channels(2),
+      m_SampleRate(44100)
+{
+}
+
+void Session::set_format(int channels, int sampleRate) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (channels == m_Channels && sampleRate == m_SampleRate) {
+        return;
+    }
+
+    for (auto& track : m_Tracks) {
+        std::vector<float> converted = remap_channels(track->samples, m_Channels, channels);
+        track->samples = resample_linear(converted, channels, m_SampleRate, sampleRate);
+        track->offset = (size_t)((double)track->offset * sampleRate / m_SampleRate);
+    }
+
+    m_Channels = channels;
+    m_SampleRate = sampleRate;
+    // The bus is sized in samples, so a new channel count needs a new one.
+    m_Bus.clear();
+}
+
+size_t Session::add_track(const std::string& name, std::vector<float> samples,
+                          int channels, int sampleRate)
+{
+    if (channels != m_Channels) {
+        samples = remap_channels(samples, channels, m_Channels);
+    }
+    if (sampleRate != m_SampleRate) {
+        samples = resample_linear(samples, m_Channels, sampleRate, m_SampleRate);
+    }
+
+    std::unique_ptr<Track> track(new Track);
+    track->name = name;
+    track->samples.swap(samples);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Tracks.push_back(std::move(track));
+    return m_Tracks.size() - 1;
+}
+
+void Session::remove_track(size_t index) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (index < m_Tracks.size()) {
+        m_Tracks.erase(m_Tracks.begin() + index);
+    }
+}
+
+void Session::clear() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Tracks.clear();
+}
+
+size_t Session::length_frames() const {
+    size_t length = 0;
+    for (const auto& track : m_Tracks) {
+        length = std::max(length, track->offset + track->samples.size() / m_Channels);
+    }
+    return length;
+}
+
+void Session::prepare(size_t maxFrames) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Bus.assign(maxFrames * m_Channels, 0.0f);
+}
+
+void Session::render_tracks(float* bus, size_t startFrame, size_t frames) const {
+    const size_t channels = m_Channels;
+    std::fill(bus, bus + frames * channels, 0.0f);
+
+    for (const auto& track : m_Tracks) {
+        if (track->mute) {
+            continue;
+        }
+
+        const size_t offset = track->offset;
+        const size_t trackFrames = track->samples.size() / channels;
+        const size_t begin = std::max(startFrame, offset);
+        const size_t end = std::min(startFrame + frames, offset + trackFrames);
+        if (begin >= end) {
+            continue;
+        }
+
+        const float gain = track->gain;
+        float gainL = gain;
+        float gainR = gain;
+        if (channels == 2) {
+            const float pan = track->pan;
+            gainL *= std::min(1.0f, 1.0f - pan);
+            gainR *= std::min(1.0f, 1.0f + pan);
+        }
+
+        add_scaled(bus + (begin - startFrame) * channels,
+                   track->samples.data() + (begin - offset) * channels,
+                   (end - begin) * channels, gainL, gainR);
+    }
+}
+
+void Session::mix(float* out, size_t startFrame, size_t frames) {
+    TRACE_SCOPE("Session::mix");
+    std::unique_lock<std::mutex> lock(m_Mutex, std::try_to_lock);
+    if (!lock.owns_lock() || m_Tracks.empty() || m_Bus.empty()) {
+        return;
+    }
+
+    const size_t busFrames = m_Bus.size() / m_Channels;
+    while (frames > 0) {
+        const size_t block = std::min(frames, busFrames);
+        render_tracks(m_Bus.data(), startFrame, block);
+        add_clamped(out, m_Bus.data(), block * m_Channels);
+        out += block * m_Channels;
+        startFrame += block;
+        frames -= block;
+    }
+}
+
+bool Session::bounce(const std::string& filename, int format,
+                     const std::vector<float>& document)
+{
+    TRACE_SCOPE("Session::bounce");
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    const size_t channels = m_Channels;
+    const size_t totalFrames = std::max(document.size() / channels, length_frames());
+
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+    sfinfo.samplerate = m_SampleRate;
+    sfinfo.channels = m_Channels;
+    sfinfo.format = format;
+
+    SNDFILE* file = sf_open(filename.c_str(), SFM_WRITE, &sfinfo);
+    if (!file) {
+        return false;
+    }
+
+    // Render a batch of chunks in parallel, then write the batch in order
+    // so memory use stays bounded for long sessions.
+    WorkerPool& pool = WorkerPool::shared();
+    const size_t batchChunks = std::max(1u, pool.size()) * 2;
+    std::vector<float> batch(batchChunks * kBounceChunkFrames * channels);
+    bool ok = true;
+
+    for (size_t batchStart = 0; ok && batchStart < totalFrames;
+         batchStart += batchChunks * kBounceChunkFrames) {
+        const size_t batchFrames = std::min(batchChunks * kBounceChunkFrames,
+                                            totalFrames - batchStart);
+        const size_t chunks = (batchFrames + kBounceChunkFrames - 1) / kBounceChunkFrames;
+
+        pool.parallel_for(chunks, [&](size_t chunk) {
+            const size_t chunkStart = batchStart + chunk * kBounceChunkFrames;
+            const size_t chunkFrames = std::min(kBounceChunkFrames,
+                                                batchStart + batchFrames - chunkStart);
+            float* out = batch.data() + chunk * kBounceChunkFrames * channels;
+            const size_t count = chunkFrames * channels;
+
+            const size_t docBegin = std::min(chunkStart * channels, document.size());
+            const size_t docEnd = std::min(docBegin + count, document.size());
+            std::copy(document.begin() + docBegin, document.begin() + docEnd, out);
+            std::fill(out + (docEnd - docBegin), out + count, 0.0f);
+
+            std::vector<float> bus(count);
+            render_tracks(bus.data(), chunkStart, chunkFrames);
+            add_clamped(out, bus.data(), count);
+        });
+
+        const sf_count_t samples = (sf_count_t)(batchFrames * channels);
+        ok = sf_write_float(file, batch.data(), samples) == samples;
+    }
+
+    sf_close(file);
+    return ok;
+}
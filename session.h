@@ -0,0 +1,73 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// One clip in the session. Samples are interleaved at the session's
+// channel count and sample rate; the mix parameters are atomics so the
+// GUI can change them while the audio callback is reading.
+struct Track {
+    Track();
+
+    std::string name;
+    std::vector<float> samples;
+
+    std::atomic<float> gain;     // linear
+    std::atomic<float> pan;      // -1 (left) .. +1 (right), stereo only
+    std::atomic<bool> mute;
+    std::atomic<size_t> offset;  // start position in frames
+};
+
+// A set of tracks mixed on top of the document buffer during playback
+// and when bouncing. Structural changes (adding, removing, reformatting
+// tracks) take the session lock; the audio callback only ever try-locks
+// it and plays the document alone for a block if it loses the race.
+class Session {
+public:
+    Session();
+
+    void set_format(int channels, int sampleRate);
+    int channels() const { return m_Channels; }
+    int sample_rate() const { return m_SampleRate; }
+
+    // Adds a track, converting it to the session format first.
+    size_t add_track(const std::string& name, std::vector<float> samples,
+                     int channels, int sampleRate);
+    void remove_track(size_t index);
+    void clear();
+
+    size_t track_count() const { return m_Tracks.size(); }
+    Track& track(size_t index) { return *m_Tracks[index]; }
+
+    // End of the last track, in frames.
+    size_t length_frames() const;
+
+    // Size the scratch bus for callbacks of up to maxFrames frames. Must
+    // be called before the stream starts; mix() never allocates.
+    void prepare(size_t maxFrames);
+
+    // Called from the audio callback. Adds every unmuted track to the
+    // interleaved block in out and clamps the result.
+    void mix(float* out, size_t startFrame, size_t frames);
+
+    // Render the document plus all tracks to a file. The mix is rendered
+    // in chunks on the worker pool and written out in order.
+    bool bounce(const std::string& filename, int format,
+                const std::vector<float>& document);
+
+private:
+    void render_tracks(float* bus, size_t startFrame, size_t frames) const;
+
+    std::vector<std::unique_ptr<Track>> m_Tracks;
+    std::vector<float> m_Bus;
+    std::mutex m_Mutex;
+    int m_Channels;
+    int m_SampleRate;
+};
+
+#endif
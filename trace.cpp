@@ -0,0 +1,226 @@
+#include "trace.h"
+
+#ifdef MR_TRACING
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+namespace trace {
+
+namespace {
+
+const uint64_t kEventsPerThread = 1 << 16;
+const size_t kMaxBuffers = 256;
+
+struct Event {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+};
+
+// Written only by the thread that holds it. The exporter copies it while
+// it may still be written, and then drops anything the writer lapped
+// meanwhile. A buffer goes back to the registry when its thread exits and
+// keeps its events, so a tid stands for a buffer, not for one thread.
+struct ThreadBuffer {
+    explicit ThreadBuffer(unsigned id)
+        : events(kEventsPerThread), head(0), name(nullptr), inUse(false), tid(id) {}
+
+    std::vector<Event> events;
+    std::atomic<uint64_t> head;
+    std::atomic<const char*> name;
+    std::atomic<bool> inUse;
+    unsigned tid;
+};
+
+// Every PortAudio stream runs its callback on a new thread, so buffers
+// are recycled rather than created per thread. A few are allocated up
+// front and claimed with a compare-and-swap, which keeps the first span
+// on the audio thread from allocating or locking. Slots are only ever
+// added, so they can be scanned without the lock.
+class Registry {
+public:
+    Registry() : m_Count(0) {
+        const unsigned initial = std::max(4u, std::thread::hardware_concurrency()) + 4;
+        for (unsigned i = 0; i < initial; i++) {
+            add();
+        }
+    }
+
+    ThreadBuffer* acquire() {
+        for (;;) {
+            const size_t count = m_Count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; i++) {
+                bool expected = false;
+                if (m_Slots[i]->inUse.compare_exchange_strong(expected, true,
+                                                              std::memory_order_acq_rel)) {
+                    return m_Slots[i];
+                }
+            }
+
+            // Every buffer is taken, so make another unless someone else
+            // just did, and look again
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (m_Count.load(std::memory_order_relaxed) == count) {
+                if (count == kMaxBuffers) {
+                    return nullptr;
+                }
+                add();
+            }
+        }
+    }
+
+    size_t count() const { return m_Count.load(std::memory_order_acquire); }
+    ThreadBuffer* slot(size_t index) const { return m_Slots[index]; }
+
+private:
+    // Called from the constructor or with m_Mutex held
+    void add() {
+        const size_t index = m_Count.load(std::memory_order_relaxed);
+        m_Slots[index] = new ThreadBuffer(index + 1);
+        m_Count.store(index + 1, std::memory_order_release);
+    }
+
+    ThreadBuffer* m_Slots[kMaxBuffers];
+    std::atomic<size_t> m_Count;
+    std::mutex m_Mutex;
+};
+
+// Never destroyed, since threads may still be tracing during exit
+Registry& registry() {
+    static Registry* instance = new Registry;
+    return *instance;
+}
+
+// Holds this thread's buffer and hands it back when the thread exits
+struct BufferOwner {
+    BufferOwner() : buffer(registry().acquire()) {}
+    ~BufferOwner() {
+        if (buffer) {
+            buffer->inUse.store(false, std::memory_order_release);
+        }
+    }
+
+    ThreadBuffer* buffer;
+};
+
+uint64_t now_ns() {
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - epoch).count();
+}
+
+// Null only if kMaxBuffers threads are tracing at once
+ThreadBuffer* local_buffer() {
+    static thread_local BufferOwner owner;
+    return owner.buffer;
+}
+
+void write_string(FILE* file, const char* text) {
+    fputc('"', file);
+    for (const char* p = text; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*p, file);
+    }
+    fputc('"', file);
+}
+
+}
+
+Span::Span(const char* name)
+    : m_Name(name),
+      m_Start(now_ns())
+{
+}
+
+Span::~Span() {
+    const uint64_t end = now_ns();
+    ThreadBuffer* buffer = local_buffer();
+    if (!buffer) {
+        return;
+    }
+    const uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    Event& event = buffer->events[head % kEventsPerThread];
+    event.name = m_Name;
+    event.start = m_Start;
+    event.duration = end - m_Start;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void set_thread_name(const char* name) {
+    ThreadBuffer* buffer = local_buffer();
+    if (buffer) {
+        buffer->name.store(name, std::memory_order_relaxed);
+    }
+}
+
+std::string default_path() {
+    const char* path = getenv("MR_TRACE_FILE");
+    if (path && path[0]) {
+        return path;
+    }
+    const char* tmp = getenv("TMPDIR");
+    char name[64];
+    snprintf(name, sizeof(name), "/mate-recorder-trace-%d.json", (int)getpid());
+    return std::string(tmp && tmp[0] ? tmp : "/tmp") + name;
+}
+
+bool export_json(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+    bool first = true;
+
+    const size_t count = registry().count();
+    for (size_t slot = 0; slot < count; slot++) {
+        const ThreadBuffer* buffer = registry().slot(slot);
+        const char* name = buffer->name.load(std::memory_order_relaxed);
+        if (name) {
+            fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                    first ? "" : ",", buffer->tid);
+            write_string(file, name);
+            fputs("}}", file);
+            first = false;
+        }
+
+        const uint64_t head = buffer->head.load(std::memory_order_acquire);
+        const uint64_t begin = head > kEventsPerThread ? head - kEventsPerThread : 0;
+        std::vector<Event> events;
+        for (uint64_t i = begin; i < head; i++) {
+            events.push_back(buffer->events[i % kEventsPerThread]);
+        }
+
+        // Anything the writer has reached again since we started copying,
+        // including the slot it may be filling right now, could be torn
+        const uint64_t after = buffer->head.load(std::memory_order_acquire);
+        const uint64_t valid = after + 1 > kEventsPerThread ? after + 1 - kEventsPerThread : 0;
+
+        for (uint64_t i = std::max(begin, valid); i < head; i++) {
+            const Event& event = events[i - begin];
+            fprintf(file, "%s\n{\"name\":", first ? "" : ",");
+            write_string(file, event.name);
+            fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    buffer->tid, event.start / 1000.0, event.duration / 1000.0);
+            first = false;
+        }
+    }
+
+    fputs("\n]}\n", file);
+    return fclose(file) == 0;
+}
+
+}
+
+#endif
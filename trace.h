@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Scoped trace spans, exported as Chrome trace-event JSON (loadable in
+// chrome://tracing or ui.perfetto.dev). Everything here compiles away
+// unless the build is configured with -DENABLE_TRACING=ON.
+//
+//     TRACE_SCOPE("AudioApp::load_audio_file");
+//
+// Each thread records into its own ring buffer with no locking. Buffers
+// are preallocated and recycled as threads come and go, so tracing the
+// audio callback neither allocates nor locks.
+
+#ifdef MR_TRACING
+
+#include <cstdint>
+#include <string>
+
+namespace trace {
+
+class Span {
+public:
+    explicit Span(const char* name);
+    ~Span();
+
+private:
+    const char* m_Name;
+    uint64_t m_Start;
+};
+
+// Kept by pointer, so name must be a literal or otherwise never freed.
+void set_thread_name(const char* name);
+
+// Where the trace goes on exit: $MR_TRACE_FILE, or a per-process file in
+// the temporary directory.
+std::string default_path();
+
+bool export_json(const std::string& path);
+
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace::Span TRACE_CONCAT(traceSpan_, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) trace::set_thread_name(name)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_THREAD_NAME(name) do {} while (0)
+
+#endif
+
+#endif
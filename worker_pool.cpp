@@ -0,0 +1,119 @@
+#include "worker_pool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+WorkerPool::WorkerPool(unsigned threads)
+    : m_Stopping(false)
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        m_Threads.push_back(std::thread(&WorkerPool::worker_loop, this));
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stopping = true;
+    }
+    m_Condition.notify_all();
+    for (auto& thread : m_Threads) {
+        thread.join();
+    }
+}
+
+WorkerPool& WorkerPool::shared() {
+    static WorkerPool pool;
+    return pool;
+}
+
+void WorkerPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Tasks.push_back(std::move(task));
+    }
+    m_Condition.notify_one();
+}
+
+void WorkerPool::worker_loop() {
+    TRACE_THREAD_NAME("worker");
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Condition.wait(lock, [this] { return m_Stopping || !m_Tasks.empty(); });
+            if (m_Tasks.empty()) {
+                return;
+            }
+            task = std::move(m_Tasks.front());
+            m_Tasks.pop_front();
+        }
+        TRACE_SCOPE("WorkerPool::task");
+        task();
+    }
+}
+
+namespace {
+
+struct ParallelForState {
+    std::atomic<size_t> next;
+    size_t count;
+    size_t done;
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::function<void(size_t)> body;
+};
+
+void run_indices(ParallelForState& state) {
+    size_t processed = 0;
+    for (;;) {
+        size_t index = state.next.fetch_add(1);
+        if (index >= state.count) {
+            break;
+        }
+        state.body(index);
+        processed++;
+    }
+    if (processed > 0) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.done += processed;
+        if (state.done == state.count) {
+            state.finished.notify_all();
+        }
+    }
+}
+
+}
+
+void WorkerPool::parallel_for(size_t count, const std::function<void(size_t)>& body) {
+    if (count == 0) {
+        return;
+    }
+    if (count == 1) {
+        body(0);
+        return;
+    }
+
+    // Helpers may be dequeued after we have returned, so the state they
+    // touch is reference counted rather than living on this stack frame.
+    std::shared_ptr<ParallelForState> state(new ParallelForState);
+    state->next = 0;
+    state->count = count;
+    state->done = 0;
+    state->body = body;
+
+    size_t helpers = std::min<size_t>(count - 1, m_Threads.size());
+    for (size_t i = 0; i < helpers; i++) {
+        submit([state] { run_indices(*state); });
+    }
+
+    run_indices(*state);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&state] { return state->done == state->count; });
+}
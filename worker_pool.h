@@ -0,0 +1,41 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads shared by the offline audio jobs
+// (bounce, import, analysis, effects). Never used from the audio callback.
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned threads = 0);
+    ~WorkerPool();
+
+    // Queue a task to run on one of the workers.
+    void submit(std::function<void()> task);
+
+    // Run body(0) .. body(count - 1) across the pool and wait for all of
+    // them. The calling thread takes part, so this is safe to call from a
+    // worker as well.
+    void parallel_for(size_t count, const std::function<void(size_t)>& body);
+
+    unsigned size() const { return (unsigned)m_Threads.size(); }
+
+    static WorkerPool& shared();
+
+private:
+    void worker_loop();
+
+    std::vector<std::thread> m_Threads;
+    std::deque<std::function<void()>> m_Tasks;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    bool m_Stopping;
+};
+
+#endif